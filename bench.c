@@ -0,0 +1,477 @@
+// Microbenchmarks of the interpreter, memory and renderer hot paths.
+// Built and run with `./build.sh bench`. main.c is included rather than
+// linked so the static handlers are reachable.
+#define BENCH
+#include "main.c"
+
+// Each benchmark runs `fn` for n operations. n is calibrated once so a
+// repetition lasts at least min_time, then the benchmark is repeated and
+// reported as the median ns/op, the fastest repetition and the median
+// absolute deviation relative to the median.
+typedef void (*bench_fn)(void *ctx, uint64_t n);
+
+typedef struct {
+    uint32_t reps;
+    double min_time;
+    const char *filter; // Substring of the benchmark names to run
+} bench_config;
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_time(bench_fn fn, void *ctx, uint64_t n) {
+    double start = now_seconds();
+    fn(ctx, n);
+    return now_seconds() - start;
+}
+
+static void bench_run(const bench_config *c, const char *name, bench_fn fn, void *ctx) {
+    if (c->filter && !strstr(name, c->filter)) return;
+
+    // Calibration doubles as warmup
+    uint64_t n = 1;
+    double elapsed;
+    while ((elapsed = bench_time(fn, ctx, n)) < c->min_time) {
+        // Aim 20% past min_time, at least doubling n
+        double scale = elapsed > 0 ? c->min_time / elapsed * 1.2 : 2;
+        n = scale > 2 ? n * scale : n * 2;
+    }
+
+    double samples[c->reps];
+    double deviations[c->reps];
+    for (uint32_t r = 0; r < c->reps; r++) samples[r] = bench_time(fn, ctx, n) * 1e9 / n;
+    qsort(samples, c->reps, sizeof(double), double_cmp);
+    double median = samples[c->reps / 2];
+    for (uint32_t r = 0; r < c->reps; r++) deviations[r] = samples[r] > median ? samples[r] - median : median - samples[r];
+    qsort(deviations, c->reps, sizeof(double), double_cmp);
+
+    printf("%-28s %10.2f ns/op  min %10.2f  mad %5.1f%%  (%llu ops x %u)\n",
+           name, median, samples[0], 100 * deviations[c->reps / 2] / median,
+           (unsigned long long)n, c->reps);
+    fflush(stdout);
+}
+
+// Keeps the compiler from dropping reads whose result is unused
+static volatile uint8_t bench_sink;
+
+// A cart kept in memory: the fixed bank, a second ROM bank for the bank
+// window and one video bank
+#define BENCH_PC 0x0100
+
+static uint8_t bench_content[2 * ROM_BANK_SIZE + VIDEO_BANK_SIZE];
+
+static void bench_cart(cartdridge *cart) {
+    *cart = (cartdridge){
+        .header = { .rom_bank_count = 2, .video_bank_count = 1, .target_fps = 60 },
+        .content = bench_content,
+    };
+}
+
+// vm_exec_opcode: one instruction at BENCH_PC, re-executed in place. The
+// operands are picked so every mode stays in bounds: immediates and
+// memory operands resolve to 1, register operands use r1 = 1, and 16 bits
+// addresses point to RAM at 0x8101 (r2:r3 for @x,y).
+static bool bench_opcode_valid(uint8_t opcode, uint8_t mode) {
+    // Only JAL/JEQ/JNE exist, and register indices must stay below 8
+    if (opcode == JMP) return mode <= 2;
+    if (opcode == SAR || opcode == POP) return mode != 3 && mode != 5 && (mode != 7 || opcode == POP);
+    return true;
+}
+
+static void bench_opcode_setup(vm *v, cartdridge *cart, uint8_t value) {
+    uint8_t mode = value >> 5;
+    memset(bench_content, 1, ROM_BANK_SIZE);
+    bench_content[BENCH_PC] = value;
+    bench_content[BENCH_PC + 1] = mode == 5 ? 2 : mode >= 3 ? 0x81 : 1;
+    bench_content[BENCH_PC + 2] = mode == 5 ? 3 : 0x01;
+
+    *v = (vm){ .cart = cart };
+    vm_init(v);
+    v->ram[0x01] = 1;
+    v->regs[1] = 1;
+    v->regs[2] = 0x81;
+    v->regs[3] = 0x01;
+    // SAM @PC stores r0 over the instruction itself
+    v->regs[0] = value == (SAM | 7 << 5) ? value : 1;
+}
+
+static void bench_opcode(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    for (uint64_t i = 0; i < n; i++) {
+        v->pc = BENCH_PC;
+        v->sp = 0xFFF0;
+        vm_exec_opcode(v);
+    }
+}
+
+// Loop overhead of bench_opcode, to be subtracted from its results
+static void bench_opcode_loop(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    for (uint64_t i = 0; i < n; i++) {
+        v->pc = BENCH_PC;
+        v->sp = 0xFFF0;
+        __asm__ volatile("" : : "r"(v) : "memory");
+    }
+}
+
+static void bench_opcodes(const bench_config *c) {
+    static vm v;
+    cartdridge cart;
+    bench_cart(&cart);
+
+    printf("\nvm_exec_opcode\n");
+    bench_opcode_setup(&v, &cart, NOOP);
+    bench_run(c, "loop overhead", bench_opcode_loop, &v);
+    vm_free(&v);
+    for (uint8_t opcode = 0; opcode <= SHL; opcode++) {
+        for (uint8_t mode = 0; mode < 8; mode++) {
+            if (!bench_opcode_valid(opcode, mode)) continue;
+            uint8_t value = opcode | mode << 5;
+            char name[32];
+            format_instruction(name, sizeof(name), value);
+            // NOOP and NOT ignore their mode, tell them apart anyway
+            if (opcode == NOOP || opcode == NOT) {
+                snprintf(name + strlen(name), sizeof(name) - strlen(name), " (%s)", mode_names[mode]);
+            }
+            bench_opcode_setup(&v, &cart, value);
+            bench_run(c, name, bench_opcode, &v);
+            vm_free(&v);
+        }
+    }
+}
+
+// mem_read and mem_write over the first bytes of each region
+typedef struct {
+    const char *name;
+    uint16_t addr;
+    uint16_t mask; // Offsets from addr that are accessed
+    bool writable;
+} bench_region;
+
+static const bench_region bench_regions[] = {
+    { "ROM fixed bank", 0x0000, 0x7F, true },
+    { "ROM bank window", 0x4000, 0x7F, true },
+    { "IO scroll", 0x8001, 0x01, true },
+    { "RAM", 0x8100, 0x7F, true },
+    { "tiles", 0xA100, 0x7F, false },
+    { "GPU tiles", 0xD100, 0x7F, true },
+    { "GPU tiles/stack", 0xD300, 0xFF, true },
+    { "stack", 0xE000, 0x7F, true },
+};
+
+typedef struct {
+    vm *v;
+    const bench_region *region;
+} bench_mem;
+
+static void bench_mem_read(void *ctx, uint64_t n) {
+    bench_mem *b = ctx;
+    uint8_t sum = 0;
+    for (uint64_t i = 0; i < n; i++) sum += mem_read(b->v, b->region->addr + (i & b->region->mask));
+    bench_sink = sum;
+}
+
+static void bench_mem_write(void *ctx, uint64_t n) {
+    bench_mem *b = ctx;
+    for (uint64_t i = 0; i < n; i++) mem_write(b->v, b->region->addr + (i & b->region->mask), i);
+}
+
+static void bench_memory(const bench_config *c) {
+    static vm v;
+    cartdridge cart;
+    bench_cart(&cart);
+    memset(bench_content, 0, sizeof(bench_content));
+    v = (vm){ .cart = &cart };
+    vm_init(&v);
+
+    printf("\nmem_read / mem_write\n");
+    for (size_t i = 0; i < sizeof(bench_regions) / sizeof(bench_regions[0]); i++) {
+        bench_mem b = { &v, &bench_regions[i] };
+        char name[48];
+        snprintf(name, sizeof(name), "read %s", b.region->name);
+        bench_run(c, name, bench_mem_read, &b);
+        if (!b.region->writable) continue;
+        snprintf(name, sizeof(name), "write %s", b.region->name);
+        bench_run(c, name, bench_mem_write, &b);
+    }
+    vm_free(&v);
+}
+
+// Rendering of a real frame of the cart given on the command line
+static void bench_render_background(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    for (uint64_t i = 0; i < n; i++) {
+        v->background.valid = false;
+        render_background(v);
+    }
+}
+
+static void bench_render_unchanged(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    for (uint64_t i = 0; i < n; i++) render_background(v);
+}
+
+// Moves the first tile on screen one tile right and back, which redraws
+// the 2 to 6 cells it covers
+static void bench_render_moved(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    uint32_t e = 0;
+    int cx0, cy0, cx1, cy1;
+    while (e < TILE_MAP_SIZE && !tile_cells(&v->gpu_tiles[e], v->background.x_scrolling,
+                                            v->background.y_scrolling, &cx0, &cy0, &cx1, &cy1)) e += 3;
+    if (e == TILE_MAP_SIZE) e = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        v->gpu_tiles[e + 1] ^= 1;
+        render_background(v);
+    }
+    if (n & 1) {
+        v->gpu_tiles[e + 1] ^= 1;
+        render_background(v);
+    }
+}
+
+static screen bench_screen;
+
+// Each set of pixel kernels the CPU supports, the scalar one being the
+// reference. Tiles are random bytes, palette indices the frame's.
+typedef struct {
+    const pixel_kernels *kernels;
+    const uint8_t *gpu_memory;
+} bench_kernel;
+
+static uint8_t bench_tiles[TILE_COUNT][TILE_SIZE];
+
+static void bench_tile_unpack(void *ctx, uint64_t n) {
+    bench_kernel *b = ctx;
+    uint8_t pixels[64];
+    for (uint64_t i = 0; i < n; i++) {
+        b->kernels->tile_unpack(pixels, bench_tiles[i % TILE_COUNT]);
+        bench_sink = pixels[i % 64];
+    }
+}
+
+static void bench_palette_expand(void *ctx, uint64_t n) {
+    bench_kernel *b = ctx;
+    for (uint64_t i = 0; i < n; i++) b->kernels->palette_expand(bench_screen.pixels, b->gpu_memory, GPU_MEMORY);
+}
+
+static void bench_kernels(const bench_config *c, const vm *v) {
+    srand(1);
+    for (uint32_t t = 0; t < TILE_COUNT; t++) {
+        for (uint32_t i = 0; i < TILE_SIZE; i++) bench_tiles[t][i] = rand();
+    }
+    char name[64];
+    for (size_t k = 0; k < sizeof(pixel_kernel_sets) / sizeof(pixel_kernel_sets[0]); k++) {
+        bench_kernel b = { &pixel_kernel_sets[k], v->gpu_memory };
+        if (b.kernels->supported && !b.kernels->supported()) continue;
+        snprintf(name, sizeof(name), "tile_unpack %s", b.kernels->name);
+        bench_run(c, name, bench_tile_unpack, &b);
+        snprintf(name, sizeof(name), "palette_expand %s", b.kernels->name);
+        bench_run(c, name, bench_palette_expand, &b);
+    }
+}
+
+// The renderer the texture upload replaced, one rectangle per pixel, kept
+// to compare against
+static void bench_render_rectangles(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    for (uint64_t i = 0; i < n; i++) {
+        v->background.valid = false;
+        BeginDrawing();
+            ClearBackground(BLACK);
+            render_background(v);
+            for (uint32_t j = 0; j < GPU_MEMORY; j++) {
+                DrawRectangle(j % 128 * SCREEN_SCALE, j / 128 * SCREEN_SCALE, SCREEN_SCALE, SCREEN_SCALE,
+                              colors[v->gpu_memory[j] % COLOR_COUNT]);
+            }
+        EndDrawing();
+    }
+}
+
+static void bench_render_game(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    for (uint64_t i = 0; i < n; i++) {
+        v->background.valid = false;
+        BeginDrawing();
+            ClearBackground(BLACK);
+            render_game(&bench_screen, v);
+        EndDrawing();
+    }
+}
+
+static void bench_run_frame(void *ctx, uint64_t n) {
+    vm *v = ctx;
+    for (uint64_t i = 0; i < n; i++) vm_run_frame(v);
+}
+
+static void bench_render(const bench_config *c, const char *cart_path, uint32_t frames, bool window) {
+    static vm v;
+    cartdridge cart = {};
+    cart_load(&cart, cart_path);
+    v = (vm){ .cart = &cart };
+    vm_init(&v);
+    for (uint32_t i = 0; i < frames; i++) vm_run_frame(&v);
+
+    printf("\nframe %u of %s\n", frames, cart_path);
+    bench_run(c, "render_background", bench_render_background, &v);
+    bench_run(c, "render_background unchanged", bench_render_unchanged, &v);
+    bench_run(c, "render_background 1 moved", bench_render_moved, &v);
+    bench_kernels(c, &v);
+    // raylib does not survive InitWindow without a display
+    window = window && (getenv("DISPLAY") || getenv("WAYLAND_DISPLAY"));
+    if (window) {
+        // Hidden and without vsync, so EndDrawing does not wait
+        SetTraceLogLevel(LOG_WARNING);
+        SetConfigFlags(FLAG_WINDOW_HIDDEN);
+        InitWindow(128 * SCREEN_SCALE, 64 * SCREEN_SCALE, "8bit-console bench");
+        window = IsWindowReady();
+    }
+    if (window) {
+        screen_init(&bench_screen);
+        bench_run(c, "render_game + present", bench_render_game, &v);
+        bench_run(c, "rectangles + present", bench_render_rectangles, &v);
+        screen_free(&bench_screen);
+        CloseWindow();
+    } else if (!c->filter || strstr("render_game + present", c->filter)) {
+        printf("%-28s no window, skipped\n", "render_game + present");
+    }
+    bench_run(c, "vm_run_frame", bench_run_frame, &v);
+    vm_free(&v);
+    cart_unload(&cart);
+}
+
+// Save states, rewind and run-ahead, from the same frame as bench_render
+typedef struct {
+    vm *v;
+    save_state state;
+    rewind_buffer *rw;
+    run_ahead *ra;
+} bench_state;
+
+static void bench_state_save(void *ctx, uint64_t n) {
+    bench_state *b = ctx;
+    for (uint64_t i = 0; i < n; i++) state_save(b->v, &b->state);
+}
+
+static void bench_state_restore(void *ctx, uint64_t n) {
+    bench_state *b = ctx;
+    for (uint64_t i = 0; i < n; i++) state_restore(b->v, &b->state);
+}
+
+// A frame run and pushed, minus bench_run_frame gives the push
+static void bench_rewind_push(void *ctx, uint64_t n) {
+    bench_state *b = ctx;
+    for (uint64_t i = 0; i < n; i++) {
+        vm_run_frame(b->v);
+        rewind_push(b->rw, b->v);
+    }
+}
+
+// One refresh worth of run-ahead, the guest does not move
+static void bench_run_ahead(void *ctx, uint64_t n) {
+    bench_state *b = ctx;
+    for (uint64_t i = 0; i < n; i++) run_ahead_frame(b->ra, b->v, 0);
+}
+
+static void bench_states(const bench_config *c, const char *cart_path, uint32_t frames) {
+    static vm v;
+    cartdridge cart = {};
+    cart_load(&cart, cart_path);
+    v = (vm){ .cart = &cart };
+    vm_init(&v);
+    for (uint32_t i = 0; i < frames; i++) vm_run_frame(&v);
+
+    printf("\nsave states\n");
+    bench_state b = { .v = &v, .rw = rewind_create(64 << 20) };
+    state_save(&v, &b.state);
+    bench_run(c, "state_save", bench_state_save, &b);
+    bench_run(c, "state_restore", bench_state_restore, &b);
+    bench_run(c, "vm_run_frame + rewind_push", bench_rewind_push, &b);
+    if (b.rw->states > 1) {
+        printf("%-28s %10.0f bytes/frame\n", "rewind entries", (double)b.rw->used / (b.rw->states - 1));
+    }
+    static run_ahead ra;
+    b.ra = &ra;
+    for (ra.frames = 1; ra.frames <= 4; ra.frames *= 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "run_ahead_frame %u", ra.frames);
+        bench_run(c, name, bench_run_ahead, &b);
+    }
+    state_free(&ra.state);
+    rewind_free(b.rw);
+    state_free(&b.state);
+    vm_free(&v);
+    cart_unload(&cart);
+}
+
+// cart_load and cart_unload of carts with as many video banks as ROM banks.
+// The files are sparse, the load only maps them.
+typedef struct {
+    char path[64];
+} bench_cart_file;
+
+static void bench_cart_load(void *ctx, uint64_t n) {
+    bench_cart_file *f = ctx;
+    for (uint64_t i = 0; i < n; i++) {
+        cartdridge cart = {};
+        cart_load(&cart, f->path);
+        bench_sink = cart.header.rom_bank_count;
+        cart_unload(&cart);
+    }
+}
+
+static void bench_carts(const bench_config *c) {
+    static const uint8_t bank_counts[] = { 1, 16, 255 };
+
+    printf("\ncart_load\n");
+    for (size_t i = 0; i < sizeof(bank_counts) / sizeof(bank_counts[0]); i++) {
+        uint8_t banks = bank_counts[i];
+        bench_cart_file f;
+        snprintf(f.path, sizeof(f.path), "/tmp/8bit-bench-XXXXXX");
+        int fd = mkstemp(f.path);
+        ASSERT(fd >= 0);
+        uint8_t header[CART_HEADER_SIZE] = {};
+        memcpy(header + 2, "Bench", 5);
+        header[18] = banks;
+        header[19] = banks;
+        header[20] = 60;
+        ASSERT(write(fd, header, sizeof(header)) == sizeof(header));
+        ASSERT(ftruncate(fd, CART_HEADER_SIZE + (off_t)banks * (ROM_BANK_SIZE + VIDEO_BANK_SIZE)) == 0);
+        close(fd);
+
+        char name[32];
+        snprintf(name, sizeof(name), "cart_load %u banks", banks);
+        bench_run(c, name, bench_cart_load, &f);
+        unlink(f.path);
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_config c = { .reps = 21, .min_time = 0.002 };
+    const char *cart_path = "refresh.bin";
+    uint32_t frames = 60;
+    bool window = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) c.reps = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) c.min_time = strtod(argv[++i], NULL) / 1e3;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) c.filter = argv[++i];
+        else if (strcmp(argv[i], "--frame") == 0 && i + 1 < argc) frames = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--no-window") == 0) window = false;
+        else if (argv[i][0] != '-') cart_path = argv[i];
+        else {
+            fprintf(stderr, "Usage: %s [--reps N] [--min-time MS] [--filter NAME] [--frame N] [--no-window] [cart]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (c.reps == 0) c.reps = 1;
+
+    printf("%u repetitions of at least %.1fms per benchmark\n", c.reps, c.min_time * 1e3);
+    bench_opcodes(&c);
+    bench_memory(&c);
+    bench_render(&c, cart_path, frames, window);
+    bench_states(&c, cart_path, frames);
+    bench_carts(&c);
+    return 0;
+}
@@ -2,6 +2,14 @@
 
 set -xe
 
+# ./build.sh bench [args] builds and runs the microbenchmarks instead
+if [ "$1" = "bench" ]; then
+    shift
+    gcc -Wall -Wextra -O2 bench.c -o bench -L ./lib -lraylib -lm -lpthread -ggdb
+    ./bench "$@"
+    exit
+fi
+
 python compiler.py
-gcc -Wall -Wextra main.c -o main -L ./lib -lraylib -lm -ggdb
+gcc -Wall -Wextra -O2 main.c -o main -L ./lib -lraylib -lm -lpthread -ggdb
 ./main
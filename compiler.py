@@ -180,11 +180,170 @@ def first_pass(lines):
             instructions.append(opcode)
     return instructions, labels
 
+# Peephole optimizer
+#
+# Works on the output of first_pass split into instructions. Every
+# rewrite keeps flags, memory and the stack as the original code leaves
+# them, only r0 may differ while it is dead.
+
+JMP = 4
+POP_R0 = [6, 0]           # POP $0
+PSH_R0 = [5 | 2 << 5, 0]  # PSH @0
+
+def instruction_length(opcode):
+    code, mode = opcode & 0x1F, opcode >> 5
+    if opcode in (0, 0xFF): # NOOP and HALT never take an operand
+        return 1
+    if code == JMP: # Label
+        return 2
+    if mode in (6, 7):
+        return 1
+    if mode in (3, 4, 5):
+        return 3
+    return 2
+
+def split_program(instructions, labels):
+    program = []
+    starts = {}
+    i = 0
+    while i < len(instructions):
+        starts[i] = len(program)
+        length = instruction_length(instructions[i])
+        program.append(instructions[i:i + length])
+        i += length
+    starts[i] = len(program)
+    return program, {name: starts[index] for name, index in labels.items()}
+
+def join_program(program, labels):
+    instructions = []
+    starts = []
+    for inst in program:
+        starts.append(len(instructions))
+        instructions.extend(inst)
+    starts.append(len(instructions))
+    return instructions, {name: starts[index] for name, index in labels.items()}
+
+def remove_instructions(program, labels, removed):
+    # Labels on a removed instruction move to the next one kept
+    new_index = []
+    kept = []
+    for i, inst in enumerate(program):
+        new_index.append(len(kept))
+        if i not in removed:
+            kept.append(inst)
+    new_index.append(len(kept))
+    return kept, {name: new_index[index] for name, index in labels.items()}
+
+def is_jump(inst):
+    return inst[0] & 0x1F == JMP
+
+# Loads r0 without reading it
+def overwrites_r0(inst):
+    code, mode = inst[0] & 0x1F, inst[0] >> 5
+    if code != 1:
+        return False
+    if mode == 2:
+        return inst[1] != 0
+    if mode == 5:
+        return 0 not in inst[1:]
+    return True
+
+def thread_jumps(program, labels):
+    # Jumps to an unconditional jump go straight to its target
+    changed = False
+    for inst in program:
+        if not is_jump(inst):
+            continue
+        seen = {inst[1]}
+        while True:
+            target = labels[inst[1]]
+            if target >= len(program) or program[target][0] != JMP or program[target][1] in seen:
+                break
+            inst[1] = program[target][1]
+            seen.add(inst[1])
+            changed = True
+    return changed
+
+def jumps_to_next(program, labels):
+    return {i for i, inst in enumerate(program) if is_jump(inst) and labels[inst[1]] == i + 1}
+
+def pop_push_pairs(program, labels):
+    # POP $0 / PSH @0 puts back the byte it popped, only restoring r0.
+    # Between back-to-back macros r0 is loaded again right after.
+    targets = set(labels.values())
+    removed = set()
+    i = 0
+    while i + 2 < len(program):
+        if (program[i] == POP_R0 and program[i + 1] == PSH_R0
+                and i + 1 not in targets and overwrites_r0(program[i + 2])):
+            removed.update((i, i + 1))
+            i += 2
+        else:
+            i += 1
+    return removed
+
+def redundant_loads(program, labels):
+    # Tracks within a basic block the immediate held by r0 and the
+    # registers equal to it, to drop loads and stores that change nothing
+    targets = set(labels.values())
+    removed = set()
+    imm, regs = None, set()
+    for i, inst in enumerate(program):
+        if i in targets:
+            imm, regs = None, set()
+        code, mode = inst[0] & 0x1F, inst[0] >> 5
+        if inst[0] in (0, 0xFF) or code in (2, 5, 7): # NOOP, HALT, SAM, PSH, CMP
+            continue
+        match code, mode:
+            case 1, 0: # LDA $x
+                if imm == inst[1]:
+                    removed.add(i)
+                else:
+                    imm, regs = inst[1], set()
+            case 1, 2: # LDA @n
+                if inst[1] == 0 or inst[1] in regs:
+                    removed.add(i)
+                else:
+                    imm, regs = None, {inst[1]}
+            case 3, 0: # SAR $n
+                if inst[1] == 0 or inst[1] in regs:
+                    removed.add(i)
+                else:
+                    regs.add(inst[1])
+            case 6, 0: # POP $n
+                if inst[1] == 0:
+                    imm, regs = None, set()
+                else:
+                    regs.discard(inst[1])
+            case 4, 1 | 2: # JEQ, JNE fall through with the same registers
+                pass
+            case _:
+                imm, regs = None, set()
+    return removed
+
+def optimize(instructions, labels):
+    program, labels = split_program(instructions, labels)
+    while True:
+        changed = thread_jumps(program, labels)
+        for find in (jumps_to_next, pop_push_pairs, redundant_loads):
+            removed = find(program, labels)
+            if removed:
+                program, labels = remove_instructions(program, labels, removed)
+                changed = True
+        if not changed:
+            break
+    return join_program(program, labels) + (len(program),)
+
 def main():
     with open("loop.asm", "r") as f:
         lines = [line.strip() for line in f.readlines()]
         lines = [line for line in lines if line and not line.startswith("//")]
     instructions, labels = first_pass(lines)
+    size = len(instructions)
+    count = len(split_program(instructions, labels)[0])
+    instructions, labels, optimized_count = optimize(instructions, labels)
+    print(f"loop.asm: {size} -> {len(instructions)} bytes, "
+          f"{size - len(instructions)} bytes and {count - optimized_count} instructions saved")
 
     zero = 0
     un = 1
@@ -234,5 +393,9 @@ def main():
                     v = res.to_bytes(3, signed=False, byteorder='little')
                     f.write(v)
 
+        # Pad the video bank to its full size
+        for i in range((12 * 1024) - 16 * 16 * 8 * 3):
+            f.write(zero.to_bytes(1))
+
 if __name__ == "__main__":
     main()
@@ -2,9 +2,23 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "include/raylib.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define ABORT(x) do { fprintf(stderr, "ABORT: %s:%d: PC=%x "x"\n", __FILE__, __LINE__, v->pc); exit(1); } while(0)
+#define ABORT(x) vm_abort(v, __FILE__, __LINE__, x)
 
 #define ASSERT(x) do { if (!(x)) {fprintf(stderr, "ASSERT: %s:%d Error reading\n", __FILE__, __LINE__); exit(1);} } while(0)
 
@@ -69,8 +83,8 @@ typedef enum {
 //   - 0x8000 -> Trigger GPU Refresh
 //   - 0x8001 -> X GPU Scrolling
 //   - 0x8002 -> Y GPU Scrolling
-//   - 0x8003 -> ROM Bank Pointer
-//   - 0x8004 -> Video Bank Pointer
+//   - 0x8003 -> ROM Bank Pointer (bank mapped at 0x4000, 0 maps bank 1)
+//   - 0x8004 -> Video Bank Pointer (bank mapped at 0xA100)
 //   - 0x8005 -> Input
 // 0x8100 - 0xA0FF -> RAM (8Kb)
 // 0xA100 - 0xD0FF -> Tile Map Bank (512 Tiles of 24 bytes each = 12Kb)
@@ -82,6 +96,9 @@ typedef enum {
 // 0xD36C - 0xD1FF -> Nothing
 // 0xD200 - 0xFFFF -> Stack (12Kb) //TODO: May be used by something else later
 
+#define ROM_BANK_SIZE   (16 * 1024)
+#define VIDEO_BANK_SIZE (12 * 1024)
+
 typedef struct {
     uint16_t entrypoint;
     uint8_t game_name[16];
@@ -90,13 +107,94 @@ typedef struct {
     uint8_t target_fps;
 } game_header;
 
+#define CART_HEADER_SIZE 21
+
+// A cart is read-only once loaded and can be shared by any number of vm
 typedef struct {
     game_header header;
-    uint8_t *content;
+    const uint8_t *content;
+    const uint8_t *data; // Whole cart file mapping
+    size_t size;
 } cartdridge;
 
+// Translation cache for the fixed ROM bank (0x0000 - 0x3FFF).
+// Basic blocks are decoded once into a list of decoded_op whose operand
+// bytes are already fetched, and run without going through mem_read.
+#define TC_ROM_END    0x3FFF
+#define TC_MAX_BLOCK  64
+#define TC_MAX_OPS    (1 << 16)
+
+typedef struct vm vm;
+typedef struct tracer tracer;
+typedef struct decoded_op decoded_op;
+typedef void (*jit_block)(vm *v);
+
+typedef struct {
+    uint16_t start;
+    uint16_t end; // Last ROM byte covered by the block
+    uint32_t first_op;
+    uint32_t op_count;
+    uint32_t hits;    // Times the block was entered, used to find hot blocks
+    jit_block native; // Compiled block, NULL while interpreted
+} tc_block;
+
+typedef struct {
+    uint16_t *index; // PC -> block number + 1, 0 when not translated
+    tc_block *blocks;
+    uint32_t block_count;
+    uint32_t block_cap;
+    decoded_op *ops;
+    uint32_t op_count;
+    uint32_t op_cap;
+    uint8_t code_map[(TC_ROM_END + 1) / 8]; // ROM bytes covered by a block
+
+    bool jit_enabled;
+    uint8_t *jit_code;
+    uint32_t jit_used;
+} translation_cache;
+
+#define PAGE_SIZE 0x100
+
+#define ROM_BANK_PAGES (ROM_BANK_SIZE / PAGE_SIZE)
+
+typedef struct {
+    const uint8_t *mem; // Host memory of the page, NULL when handled by io
+    uint8_t (*io)(vm *v, uint16_t addr);
+} read_page;
+
+typedef struct {
+    uint8_t *mem;
+    void (*io)(vm *v, uint16_t addr, uint8_t value);
+} write_page;
+
+// Background tiles (0xA100 - 0xB8FF) of the mapped video bank decoded to
+// one palette index per byte, filled on first use. Tile bytes are
+// read-only cart content, so only mapping another bank invalidates them.
+#define TILE_SIZE  24 // 8x8 pixels of 3 bits
+#define TILE_COUNT 256
+
 typedef struct {
-    uint8_t system_io[0xFF];
+    const uint8_t *bank; // Host memory of the decoded bank
+    uint64_t valid[TILE_COUNT / 64];
+    uint8_t pixels[TILE_COUNT][64];
+} tile_cache;
+
+// Tile map (0xD100 - 0xD2CA, 153 entries of index, x, y) and scroll the
+// background in gpu_memory was drawn from. render_background compares them
+// with the current ones and only redraws the 8x8 screen cells covered by
+// the old or new position of a changed entry. Anything else writing
+// gpu_memory must clear `valid`, which forces a full redraw.
+#define TILE_MAP_SIZE ((17 * 9) * 3)
+
+typedef struct {
+    uint8_t tile_map[TILE_MAP_SIZE];
+    uint8_t x_scrolling;
+    uint8_t y_scrolling;
+    bool valid;
+} background_state;
+
+struct vm {
+    uint8_t system_io[0x100];
     uint8_t ram[0x2000];
     uint8_t gpu_tiles[619];
     uint8_t stack[0x3000];
@@ -105,15 +203,52 @@ typedef struct {
     uint16_t sp;
     uint16_t pc;
     uint8_t flags;
+    uint64_t instret; // Instructions executed
+    uint64_t halts;   // HALT instructions executed
 
     uint8_t gpu_memory[GPU_MEMORY];
     uint16_t gpu_pointer;
 
     cartdridge *cart;
-} vm;
+    // ROM pages this vm wrote to, indexed by page number in the cart
+    // content. A page is copied on its first write, NULL pages are still
+    // shared with the cart.
+    uint8_t **rom_copies;
+    uint8_t rom_bank; // Bank mapped in the bank window
+    uint64_t rom_writes;
+
+    // Built by vm_init from the cart, the vm must not move afterwards
+    read_page read_pages[256];
+    write_page write_pages[256];
+
+    translation_cache tc;
+    tile_cache tiles;
+    background_state background;
+    // Set by writes that must stop the current block: GPU refresh and
+    // writes over translated code
+    bool break_block;
+
+    // Where ABORT jumps to when set, the process exits otherwise
+    jmp_buf *on_abort;
+    // Set while tracing, vm_step then records what it runs
+    tracer *trace;
+    // HALT dumps the state and waits for a key on stdin. Only the windowed
+    // front end sets it, elsewhere HALT is just counted.
+    bool wait_on_halt;
+};
+
+__attribute__((noreturn)) void vm_abort(vm *v, const char *file, int line, const char *msg) {
+    fprintf(stderr, "ABORT: %s:%d: PC=%x %s\n", file, line, v->pc, msg);
+    if (v->on_abort) longjmp(*v->on_abort, 1);
+    exit(1);
+}
 
 uint8_t mem_read(vm *v, uint16_t addr);
 void mem_write(vm *v, uint16_t addr, uint8_t value);
+void map_memory(vm *v);
+void map_rom_bank(vm *v);
+void map_video_bank(vm *v);
+void tc_invalidate(vm *v, uint16_t addr);
 
 void dump(vm *v) {
     printf("PC=%d\n", v->pc);
@@ -129,341 +264,3021 @@ void dump(vm *v) {
 
 void vm_init(vm *v) {
     for (uint16_t i = 0; i < 0x2000; i++)     v->ram[i] = 0;
-    for (uint16_t i = 0; i < 0xFF; i++)       v->system_io[i] = 0;
+    for (uint16_t i = 0; i < 0x100; i++)      v->system_io[i] = 0;
     for (uint16_t i = 0; i < 0x3000; i++)     v->stack[i] = 0;
     for (uint16_t i = 0; i < GPU_MEMORY; i++) v->gpu_memory[i] = 0;
     for (uint16_t i = 0; i < 619; i++)        v->gpu_tiles[i] = 255;
     for (uint8_t i = 0; i < REG_COUNT; i++)   v->regs[i] = 0;
     v->pc = 0;
     v->sp = 0xFFFF;
+    v->tiles.bank = NULL;
+    v->background.valid = false;
+    map_memory(v);
 }
 
+// The cart is mapped read-only: nothing is read at load time and banks are
+// only paged in when a VM touches them.
 void cart_load(cartdridge *cart, const char *binary) {
-    FILE *f = fopen(binary, "rb");
-    if (!f) {
+    int fd = open(binary, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "Can't open file");
         exit(1);
     }
 
-    ASSERT(fread(&cart->header.entrypoint, sizeof(uint16_t), 1, f));
-    ASSERT(fread(&cart->header.game_name, sizeof(uint8_t), 16, f));
-    ASSERT(fread(&cart->header.rom_bank_count, sizeof(uint8_t), 1, f));
-    ASSERT(fread(&cart->header.video_bank_count, sizeof(uint8_t), 1, f));
-    ASSERT(fread(&cart->header.target_fps, sizeof(uint8_t), 1, f));
+    struct stat st;
+    ASSERT(fstat(fd, &st) == 0);
+    if (st.st_size < CART_HEADER_SIZE) {
+        fprintf(stderr, "Invalid cartdridge: file too small for the header\n");
+        exit(1);
+    }
+
+    uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    ASSERT(data != MAP_FAILED);
 
-    uint32_t content_size = cart->header.rom_bank_count * (16 * 1024) 
-                            + cart->header.video_bank_count * (12 * 1024);
-    cart->content = malloc(sizeof(uint8_t) * content_size);
-    ASSERT(cart->content != NULL);
+    memcpy(&cart->header.entrypoint, data, sizeof(uint16_t));
+    memcpy(&cart->header.game_name, data + 2, 16);
+    cart->header.rom_bank_count = data[18];
+    cart->header.video_bank_count = data[19];
+    cart->header.target_fps = data[20];
 
-    uint8_t buff[16];
-    uint16_t ptr = 0;
-    uint8_t n = 0;
-    while ((n = fread(&buff, sizeof(uint8_t), 16, f))) {
-        for (uint8_t i = 0; i < n; i++) {
-            cart->content[ptr] = buff[i];
-            ptr++;
-        }
+    size_t content_size = cart->header.rom_bank_count * ROM_BANK_SIZE
+                          + cart->header.video_bank_count * VIDEO_BANK_SIZE;
+    if (cart->header.rom_bank_count == 0 || (size_t)st.st_size - CART_HEADER_SIZE != content_size) {
+        fprintf(stderr, "Invalid cartdridge: %d ROM banks and %d video banks need %zu bytes, found %zu\n",
+                cart->header.rom_bank_count, cart->header.video_bank_count,
+                content_size, (size_t)st.st_size - CART_HEADER_SIZE);
+        exit(1);
     }
-    fclose(f);
+
+    cart->data = data;
+    cart->size = st.st_size;
+    cart->content = data + CART_HEADER_SIZE;
 }
 
-//TODO: Bound checking
-uint8_t mem_read(vm *v, uint16_t addr) {
-    if (addr <= 0x3FFF) return v->cart->content[addr & 0x3FFF];
-    //TODO: Based on bank
-    if (addr <= 0x7FFF) {
-        if (v->cart->header.rom_bank_count == 1) {
-            ABORT("There is only one fixed bank.");
-        }
-        return v->cart->content[addr];
-    }
-    if (addr <= 0x80FF) return v->system_io[addr & 0xFF];
-    if (addr <= 0xA0FF) return v->ram[addr - 0x8100];
-    //TODO: Based on bank
-    if (addr <= 0xD0FF) return v->cart->content[addr - 0xA100 + 0x4000];
+void cart_unload(cartdridge *cart) {
+    munmap((void *)cart->data, cart->size);
+    cart->data = NULL;
+    cart->content = NULL;
+}
+
+// Memory accesses go through a page table with one entry per 256 bytes
+// page. Plain memory pages point to their host memory, the others are
+// handled by an io function.
+static uint8_t rom_window_read(vm *v, uint16_t addr) {
+    (void)addr;
+    ABORT("There is only one fixed bank.");
+}
+
+static void rom_window_write(vm *v, uint16_t addr, uint8_t value) {
+    (void)addr; (void)value;
+    ABORT("There is only one fixed bank.");
+}
+
+static const uint8_t *rom_page(vm *v, uint32_t page) {
+    if (v->rom_copies && v->rom_copies[page]) return v->rom_copies[page];
+    return v->cart->content + page * PAGE_SIZE;
+}
+
+// Writes to ROM go to a private copy of the page, the cart stays shared
+static void rom_write(vm *v, uint16_t addr, uint8_t value) {
+    uint32_t page = addr <= 0x3FFF
+        ? addr >> 8
+        : v->rom_bank * ROM_BANK_PAGES + ((addr - 0x4000) >> 8);
+    if (!v->rom_copies) {
+        v->rom_copies = calloc(v->cart->header.rom_bank_count * ROM_BANK_PAGES, sizeof(uint8_t *));
+        ASSERT(v->rom_copies != NULL);
+    }
+    if (!v->rom_copies[page]) {
+        uint8_t *copy = malloc(PAGE_SIZE);
+        ASSERT(copy != NULL);
+        memcpy(copy, v->cart->content + page * PAGE_SIZE, PAGE_SIZE);
+        v->rom_copies[page] = copy;
+        v->read_pages[addr >> 8].mem = copy;
+    }
+    v->rom_copies[page][addr & 0xFF] = value;
+    v->rom_writes++;
+    if (addr <= TC_ROM_END) tc_invalidate(v, addr);
+}
+
+static void io_write(vm *v, uint16_t addr, uint8_t value) {
+    v->system_io[addr & 0xFF] = value;
+    switch (addr) {
+        case 0x8000: v->break_block = true; break;
+        case 0x8003: map_rom_bank(v); break;
+        case 0x8004: map_video_bank(v); break;
+    }
+}
+
+static void tiles_write(vm *v, uint16_t addr, uint8_t value) {
+    (void)addr; (void)value;
+    ABORT("TODO: Should we be able to write directly Tile Map Bank?");
+}
+
+// 0xD300 - 0xD3FF is shared between the GPU tiles and the stack
+static uint8_t gpu_stack_read(vm *v, uint16_t addr) {
     if (addr <= 0xD36B) return v->gpu_tiles[addr - 0xD100];
-    if (addr <= 0xD1FF) ABORT("Unused memory mapping");
-    //if (addr <= 0xFFFF) 
     return v->stack[addr - 0xD200];
 }
 
-//TODO: Bound checking
-void mem_write(vm *v, uint16_t addr, uint8_t value) {
-    if (addr <= 0x3FFF) { v->cart->content[addr & 0x3FFF] = value; return; }
-    //TODO: Based on bank
-    if (addr <= 0x7FFF) {
-        if (v->cart->header.rom_bank_count == 1) {
-            ABORT("There is only one fixed bank.");
-        }
-        v->cart->content[addr] = value;
+static void gpu_stack_write(vm *v, uint16_t addr, uint8_t value) {
+    if (addr <= 0xD36B) v->gpu_tiles[addr - 0xD100] = value;
+    else v->stack[addr - 0xD200] = value;
+}
+
+static void map_read(vm *v, uint8_t first, uint8_t last, const uint8_t *mem, uint8_t (*io)(vm *, uint16_t)) {
+    for (uint16_t p = first; p <= last; p++) {
+        v->read_pages[p].mem = mem ? mem + (p - first) * PAGE_SIZE : NULL;
+        v->read_pages[p].io = io;
+    }
+}
+
+static void map_write(vm *v, uint8_t first, uint8_t last, uint8_t *mem, void (*io)(vm *, uint16_t, uint8_t)) {
+    for (uint16_t p = first; p <= last; p++) {
+        v->write_pages[p].mem = mem ? mem + (p - first) * PAGE_SIZE : NULL;
+        v->write_pages[p].io = io;
+    }
+}
+
+static uint8_t video_bank_read(vm *v, uint16_t addr) {
+    (void)addr;
+    ABORT("There is no video bank.");
+}
+
+// Maps the ROM bank selected by the ROM bank pointer in the bank window
+// (0x4000 - 0x7FFF). Bank 0 is the fixed bank, so selecting it maps bank 1.
+void map_rom_bank(vm *v) {
+    uint8_t count = v->cart->header.rom_bank_count;
+    if (count <= 1) {
+        map_read(v, 0x40, 0x7F, NULL, rom_window_read);
+        map_write(v, 0x40, 0x7F, NULL, rom_window_write);
         return;
     }
-    if (addr <= 0x80FF) { v->system_io[addr & 0xFF] = value; return; }
-    if (addr <= 0xA0FF) { v->ram[addr - 0x8100] = value; return; }
-    if (addr <= 0xD0FF) ABORT("TODO: Should we be able to write directly Tile Map Bank?");
-    if (addr <= 0xD36B) { v->gpu_tiles[addr - 0xD100] = value; return; }
-    if (addr <= 0xD1FF) ABORT("Unused memory mapping");
-    //if (addr <= 0xFFFF) 
-    v->stack[addr - 0xD200] = value;
+    v->rom_bank = v->system_io[0x03] % count;
+    if (v->rom_bank == 0) v->rom_bank = 1;
+    for (uint8_t p = 0; p < ROM_BANK_PAGES; p++) {
+        map_read(v, 0x40 + p, 0x40 + p, rom_page(v, v->rom_bank * ROM_BANK_PAGES + p), NULL);
+    }
+    map_write(v, 0x40, 0x7F, NULL, rom_write);
+}
+
+// Maps the video bank selected by the video bank pointer in the tile map
+// bank (0xA100 - 0xD0FF). Video banks are stored after the ROM banks.
+void map_video_bank(vm *v) {
+    uint8_t count = v->cart->header.video_bank_count;
+    if (count == 0) {
+        map_read(v, 0xA1, 0xD0, NULL, video_bank_read);
+    } else {
+        uint8_t bank = v->system_io[0x04] % count;
+        map_read(v, 0xA1, 0xD0, v->cart->content
+                 + v->cart->header.rom_bank_count * ROM_BANK_SIZE
+                 + bank * VIDEO_BANK_SIZE, NULL);
+    }
+    map_write(v, 0xA1, 0xD0, NULL, tiles_write);
+    if (v->tiles.bank != v->read_pages[0xA1].mem) {
+        v->tiles.bank = v->read_pages[0xA1].mem;
+        memset(v->tiles.valid, 0, sizeof(v->tiles.valid));
+        v->background.valid = false;
+    }
+}
+
+void map_memory(vm *v) {
+    for (uint8_t p = 0; p < ROM_BANK_PAGES; p++) map_read(v, p, p, rom_page(v, p), NULL);
+    map_write(v, 0x00, 0x3F, NULL, rom_write);
+    map_rom_bank(v);
+    map_read(v, 0x80, 0x80, v->system_io, NULL);
+    map_write(v, 0x80, 0x80, NULL, io_write);
+    map_read(v, 0x81, 0xA0, v->ram, NULL);
+    map_write(v, 0x81, 0xA0, v->ram, NULL);
+    map_video_bank(v);
+    map_read(v, 0xD1, 0xD2, v->gpu_tiles, NULL);
+    map_write(v, 0xD1, 0xD2, v->gpu_tiles, NULL);
+    map_read(v, 0xD3, 0xD3, NULL, gpu_stack_read);
+    map_write(v, 0xD3, 0xD3, NULL, gpu_stack_write);
+    map_read(v, 0xD4, 0xFF, v->stack + 0x200, NULL);
+    map_write(v, 0xD4, 0xFF, v->stack + 0x200, NULL);
+}
+
+uint8_t mem_read(vm *v, uint16_t addr) {
+    const read_page *p = &v->read_pages[addr >> 8];
+    if (p->mem) return p->mem[addr & 0xFF];
+    return p->io(v, addr);
+}
+
+void mem_write(vm *v, uint16_t addr, uint8_t value) {
+    const write_page *p = &v->write_pages[addr >> 8];
+    if (p->mem) p->mem[addr & 0xFF] = value;
+    else p->io(v, addr, value);
 }
 
 uint16_t advance_pc(vm *v) { v->pc++; return v->pc; }
 
-void jump(vm *v, uint8_t mode) {
-        uint16_t addr = mem_read(v, advance_pc(v));
-        switch (mode) {
-            // Always
-            case 0: v->pc = addr - 1; break;
-            // Equal
-            case 1: if(v->flags & FLAG(Z))   { v->pc = addr - 1; } break;
-            // Not Equal
-            case 2: if(!(v->flags & FLAG(Z))) { v->pc = addr - 1; } break;
-            default: printf("%d: ", mode); ABORT("Unknown jump mode");
-        }
+// Operand fetching is split in two: fetch_N reads the raw operand bytes
+// that follow the instruction and resolve_N turns them into the value
+// used by the instruction for addressing mode N.
+static inline uint16_t fetch_0(vm *v) { return mem_read(v, advance_pc(v)); }
+#define fetch_1 fetch_0
+#define fetch_2 fetch_0
+static inline uint16_t fetch_3(vm *v) {
+    uint8_t high = mem_read(v, advance_pc(v));
+    uint8_t low  = mem_read(v, advance_pc(v));
+    return high << 8 | low;
 }
+#define fetch_4 fetch_3
+#define fetch_5 fetch_3
+static inline uint16_t fetch_6(vm *v) { (void)v; return 0; }
+#define fetch_7 fetch_6
 
-uint16_t fetch_operand(vm *v, uint8_t mode) { 
-    switch (mode) {
-        // Immediate
-        case 0: return mem_read(v, advance_pc(v));
-        // Memory read
-        case 1: {
-            uint16_t addr = mem_read(v, advance_pc(v));
-            return mem_read(v, addr);
-        }
-        // Reg
-        case 2: {
-            uint8_t value = mem_read(v, advance_pc(v));
-            if (value >= REG_COUNT) {
-                ABORT("Unknown register");
-            }
-            return v->regs[value];
-        }
-        // Fetch 16 bits immediate
-        case 3: {
-            uint8_t high = mem_read(v, advance_pc(v));
-            uint8_t low  = mem_read(v, advance_pc(v));
-            return high << 8 | low;
-        }
-        // Fetch 16 bits from memory
-        case 4: {
-            uint8_t high = mem_read(v, advance_pc(v));
-            uint8_t low  = mem_read(v, advance_pc(v));
-            uint16_t addr = high << 8 | low;
-            return mem_read(v, addr);
-        }
-        // Fetch 16 bits from base and offset from reg
-        case 5: {
-            uint8_t high = v->regs[mem_read(v, advance_pc(v))];
-            uint8_t low  = v->regs[mem_read(v, advance_pc(v))];
-            return (high << 8) | low;
-        }
-        // Retrieve carry
-        case 6: return CARRY(v->flags);
-        // PC
-        case 7: return v->pc;
-        // Unknown mode
-        default: printf("%x\n", mode); ABORT("Unknown mode"); break;
+// Immediate
+static inline uint16_t resolve_0(vm *v, uint16_t raw) { (void)v; return raw; }
+// Memory read
+static inline uint16_t resolve_1(vm *v, uint16_t raw) { return mem_read(v, raw); }
+// Reg
+static inline uint16_t resolve_2(vm *v, uint16_t raw) {
+    if (raw >= REG_COUNT) {
+        ABORT("Unknown register");
     }
+    return v->regs[raw];
+}
+// 16 bits immediate
+static inline uint16_t resolve_3(vm *v, uint16_t raw) { (void)v; return raw; }
+// 16 bits from memory
+static inline uint16_t resolve_4(vm *v, uint16_t raw) { return mem_read(v, raw); }
+// 16 bits from base and offset from reg
+static inline uint16_t resolve_5(vm *v, uint16_t raw) {
+    return (v->regs[raw >> 8] << 8) | v->regs[raw & 0xFF];
+}
+// Retrieve carry
+static inline uint16_t resolve_6(vm *v, uint16_t raw) { (void)raw; return CARRY(v->flags); }
+// PC
+static inline uint16_t resolve_7(vm *v, uint16_t raw) { (void)raw; return v->pc; }
+
+#define SET_ZN(v) do { \
+    SETFLAG(v, FLAG(Z), ISZERO(v->regs[0])); \
+    SETFLAG(v, FLAG(N), ISNEG(v->regs[0])); \
+} while(0)
+
+// Instruction bodies. M is the addressing mode, a constant in every
+// handler, and OPERAND(M) resolves the raw operand bytes held in `raw`.
+#define OPERAND(M) resolve_##M(v, raw)
+#define OP_NOOP(M)
+#define OP_LDA(M) v->regs[0] = OPERAND(M);
+#define OP_SAM(M) mem_write(v, OPERAND(M), v->regs[0]);
+#define OP_SAR(M) v->regs[OPERAND(M)] = v->regs[0];
+#define OP_JMP(M) { \
+    uint16_t addr = raw; \
+    switch (M) { \
+        /* Always */ \
+        case 0: v->pc = addr - 1; break; \
+        /* Equal */ \
+        case 1: if(v->flags & FLAG(Z))   { v->pc = addr - 1; } break; \
+        /* Not Equal */ \
+        case 2: if(!(v->flags & FLAG(Z))) { v->pc = addr - 1; } break; \
+        default: printf("%d: ", M); ABORT("Unknown jump mode"); \
+    } \
+}
+#define OP_PSH(M) mem_write(v, v->sp, OPERAND(M)); v->sp--;
+#define OP_POP(M) { \
+    v->sp++; \
+    if (M == 7) { /* PC */ \
+        v->pc = mem_read(v, v->sp); \
+    } \
+    else { \
+        v->regs[OPERAND(M)] = mem_read(v, v->sp); \
+    } \
+}
+#define OP_CMP(M) { \
+    uint8_t operand = OPERAND(M); \
+    v->flags = (v->flags & ~FLAG(Z)) | (v->regs[0] == operand); \
+}
+#define OP_ADD(M) { \
+    uint16_t operand = OPERAND(M); \
+    SETFLAG(v, FLAG(C), HASCARRY(v->regs[0], operand)); \
+    SETFLAG(v, FLAG(C), ISZERO(v->regs[0])); \
+    v->regs[0] = (v->regs[0] + operand) & 0xFF; \
+    SET_ZN(v); \
+}
+#define OP_AND(M) v->regs[0] &= OPERAND(M); SET_ZN(v);
+#define OP_OR(M)  v->regs[0] |= OPERAND(M); SET_ZN(v);
+#define OP_NOT(M) v->regs[0] = ~v->regs[0]; SET_ZN(v);
+#define OP_SHR(M) v->regs[0] = (v->regs[0] >> OPERAND(M)); SET_ZN(v);
+#define OP_SHL(M) v->regs[0] = (v->regs[0] << OPERAND(M)); SET_ZN(v);
+
+// Which operand bytes an instruction consumes, given as the mode whose
+// fetch_N to use. NOOP and NOT never consume their operand bytes and JMP
+// always reads a single address byte.
+#define FETCH_MODE_NOOP(M) 6
+#define FETCH_MODE_LDA(M)  M
+#define FETCH_MODE_SAM(M)  M
+#define FETCH_MODE_SAR(M)  M
+#define FETCH_MODE_JMP(M)  0
+#define FETCH_MODE_PSH(M)  M
+#define FETCH_MODE_POP(M)  M
+#define FETCH_MODE_CMP(M)  M
+#define FETCH_MODE_ADD(M)  M
+#define FETCH_MODE_AND(M)  M
+#define FETCH_MODE_OR(M)   M
+#define FETCH_MODE_NOT(M)  6
+#define FETCH_MODE_SHR(M)  M
+#define FETCH_MODE_SHL(M)  M
+
+#define OPERAND_SIZE(mode) ((mode) >= 6 ? 0 : (mode) >= 3 ? 2 : 1)
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+#define OPCODE_LIST(X) \
+    X(NOOP) X(LDA) X(SAM) X(SAR) X(JMP) X(PSH) X(POP) \
+    X(CMP) X(ADD) X(AND) X(OR) X(NOT) X(SHR) X(SHL)
+
+#define MODE_LIST(X, op) \
+    X(op, 0) X(op, 1) X(op, 2) X(op, 3) X(op, 4) X(op, 5) X(op, 6) X(op, 7)
+
+// One handler per (opcode, mode) pair, e.g. exec_LDA_2 for "LDA @n".
+// exec_* takes the already fetched operand bytes, op_* fetches them from
+// the instruction stream first.
+#define DEFINE_HANDLER(op, m) \
+    static void exec_##op##_##m(vm *v, uint16_t raw) { (void)v; (void)raw; OP_##op(m) } \
+    static void op_##op##_##m(vm *v) { exec_##op##_##m(v, CAT(fetch_, FETCH_MODE_##op(m))(v)); }
+#define DEFINE_HANDLERS(op) MODE_LIST(DEFINE_HANDLER, op)
+OPCODE_LIST(DEFINE_HANDLERS)
+
+static void exec_halt(vm *v, uint16_t raw) {
+    (void)raw;
+    v->halts++;
+    if (!v->wait_on_halt) return;
+    printf("HALT\n");
+    dump(v);
+    getc(stdin);
 }
+static void op_halt(vm *v) { exec_halt(v, 0); }
+
+static void exec_unknown(vm *v, uint16_t raw) { (void)raw; ABORT("Unkown upcode"); }
+static void op_unknown(vm *v) { exec_unknown(v, 0); }
+
+typedef void (*op_handler)(vm *v);
+typedef void (*exec_handler)(vm *v, uint16_t raw);
+
+typedef struct {
+    exec_handler exec;
+    uint8_t length;
+} inst_info;
 
 // 0000  0000
 // mode  code
 // Mode: 0-7
 // Code: 0-31
+#define OP_ENTRY(op, m) [(op) | (m) << 5] = op_##op##_##m,
+#define OP_ENTRIES(op) MODE_LIST(OP_ENTRY, op)
+#define INFO_ENTRY(op, m) \
+    [(op) | (m) << 5] = { exec_##op##_##m, 1 + OPERAND_SIZE(FETCH_MODE_##op(m)) },
+#define INFO_ENTRIES(op) MODE_LIST(INFO_ENTRY, op)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+static const op_handler op_table[256] = {
+    [0 ... 255] = op_unknown,
+    OPCODE_LIST(OP_ENTRIES)
+    [0xFF] = op_halt,
+};
+
+static const inst_info inst_table[256] = {
+    [0 ... 255] = { exec_unknown, 1 },
+    OPCODE_LIST(INFO_ENTRIES)
+    [0xFF] = { exec_halt, 1 },
+};
+#pragma GCC diagnostic pop
 
 void vm_exec_opcode(vm *v) {
-    uint8_t value = mem_read(v, v->pc);
+    op_table[mem_read(v, v->pc)](v);
+}
+
+struct decoded_op {
+    exec_handler exec;
+    uint16_t raw;
+    uint16_t last; // Address of the last byte, the PC seen by the handler
+    uint8_t value; // Instruction byte
+    uint8_t retired; // Instructions run from the block start to this op included
+};
+
+static bool ends_block(uint8_t value) {
+    return (value & OPCODE_MASK) == JMP
+        || value == (POP | 7 << 5)
+        || inst_table[value].exec == exec_halt
+        || inst_table[value].exec == exec_unknown;
+}
+
+// Superinstructions: the register macros of loop.asm expand to fixed
+// sequences, replaced by tc_translate with a single op. The fused handler
+// takes the macro register as raw and has the same effects as the whole
+// sequence, including the byte pushed below SP. Like any op it runs with
+// PC on the last byte it covers.
+#define FUSED_REG (-1) // Macro register operand in a sequence
+
+typedef struct {
+    exec_handler exec;
+    uint8_t count;
+    uint8_t values[5];
+    int16_t raws[5];
+} fused_seq;
+
+// Runs the instructions of a fused sequence one at a time, for when SP is
+// not on plain memory and the push may have side effects
+static void fused_slow(vm *v, uint32_t count, uint32_t size) {
+    uint16_t addr = v->pc + 1 - size;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t value = mem_read(v, addr);
+        const inst_info *info = &inst_table[value];
+        uint16_t raw = info->length == 2 ? mem_read(v, addr + 1) : 0;
+        v->pc = addr + info->length - 1;
+        info->exec(v, raw);
+        if (v->break_block) {
+            v->instret -= count - 1 - i;
+            return;
+        }
+        addr = v->pc + 1;
+    }
+}
 
-    // Halt
-    if (value == 0xFF) {
-        printf("HALT\n");
-        dump(v);
-        getc(stdin);
+// PSH @0 / LDA @n / ADD $1 / SAR $n / POP $0
+static void exec_incr_reg(vm *v, uint16_t raw) {
+    uint8_t *stack = v->write_pages[v->sp >> 8].mem;
+    if (!stack) {
+        fused_slow(v, 5, 10);
         return;
     }
+    uint8_t r0 = v->regs[0];
+    stack[v->sp & 0xFF] = r0;
+    exec_LDA_2(v, raw);
+    exec_ADD_0(v, 1);
+    exec_SAR_0(v, raw);
+    v->regs[0] = r0;
+}
 
-    uint8_t opcode = value & OPCODE_MASK;
-    uint8_t mode   = (value & MODE_MASK) >> 5;
+// PSH @0 / LDA @n / ADD @C / SAR $n / POP $0
+static void exec_incr_reg_carry(vm *v, uint16_t raw) {
+    uint8_t *stack = v->write_pages[v->sp >> 8].mem;
+    if (!stack) {
+        fused_slow(v, 5, 9);
+        return;
+    }
+    uint8_t r0 = v->regs[0];
+    stack[v->sp & 0xFF] = r0;
+    exec_LDA_2(v, raw);
+    exec_ADD_6(v, 0);
+    exec_SAR_0(v, raw);
+    v->regs[0] = r0;
+}
 
-    switch (opcode) {
-        // Memory Instructions
-        case NOOP: break;
-        case LDA: v->regs[0] = fetch_operand(v, mode); break;
-        case SAM: mem_write(v, fetch_operand(v, mode), v->regs[0]); break;
-        case SAR: v->regs[fetch_operand(v, mode)] = v->regs[0]; break;
-        case JMP: jump(v, mode); break;
-        case PSH: mem_write(v, v->sp, fetch_operand(v, mode)); v->sp--; break;
-        case POP: {
-            v->sp++; 
-            if (mode == 7) { // PC
-                v->pc = mem_read(v, v->sp);
-            }
-            else {
-                v->regs[fetch_operand(v, mode)] = mem_read(v, v->sp); 
-            }
-            break;
+// PSH @0 / LDA $0 / SAR $n / POP $0
+static void exec_clear_reg(vm *v, uint16_t raw) {
+    uint8_t *stack = v->write_pages[v->sp >> 8].mem;
+    if (!stack) {
+        fused_slow(v, 4, 8);
+        return;
+    }
+    stack[v->sp & 0xFF] = v->regs[0];
+    if (raw != 0) v->regs[raw] = 0;
+}
+
+// LDA @n / ADD $1 / SAR $n and LDA @n / ADD @C / SAR $n, the macros once
+// compiler.py dropped the POP $0 / PSH @0 between back-to-back ones
+static void exec_incr(vm *v, uint16_t raw) {
+    exec_LDA_2(v, raw);
+    exec_ADD_0(v, 1);
+    exec_SAR_0(v, raw);
+}
+
+static void exec_incr_carry(vm *v, uint16_t raw) {
+    exec_LDA_2(v, raw);
+    exec_ADD_6(v, 0);
+    exec_SAR_0(v, raw);
+}
+
+static const fused_seq fused_seqs[] = {
+    { exec_incr_reg, 5, { PSH | 2 << 5, LDA | 2 << 5, ADD, SAR, POP }, { 0, FUSED_REG, 1, FUSED_REG, 0 } },
+    { exec_incr_reg_carry, 5, { PSH | 2 << 5, LDA | 2 << 5, ADD | 6 << 5, SAR, POP }, { 0, FUSED_REG, 0, FUSED_REG, 0 } },
+    { exec_clear_reg, 4, { PSH | 2 << 5, LDA, SAR, POP }, { 0, 0, FUSED_REG, 0 } },
+    { exec_incr, 3, { LDA | 2 << 5, ADD, SAR }, { FUSED_REG, 1, FUSED_REG } },
+    { exec_incr_carry, 3, { LDA | 2 << 5, ADD | 6 << 5, SAR }, { FUSED_REG, 0, FUSED_REG } },
+};
+
+// Returns the macro register when the n ops match seq, -1 otherwise
+static int fused_match(const fused_seq *seq, const decoded_op *ops, uint32_t n) {
+    if (n < seq->count) return -1;
+    int reg = -1;
+    for (uint32_t i = 0; i < seq->count; i++) {
+        if (ops[i].value != seq->values[i]) return -1;
+        if (seq->raws[i] != FUSED_REG) {
+            if (ops[i].raw != seq->raws[i]) return -1;
+        } else {
+            if (ops[i].raw >= REG_COUNT || (reg >= 0 && ops[i].raw != reg)) return -1;
+            reg = ops[i].raw;
         }
-        case CMP: {
-             uint8_t operand = fetch_operand(v, mode);
-             v->flags = (v->flags & ~FLAG(Z)) | (v->regs[0] == operand);
-             break; 
-        }
-        // Math Instructions
-        case ADD: {
-            uint16_t operand = fetch_operand(v, mode);
-            SETFLAG(v, FLAG(C), HASCARRY(v->regs[0], operand));
-            SETFLAG(v, FLAG(C), ISZERO(v->regs[0]));
-            v->regs[0] = (v->regs[0] + operand) & 0xFF;
-            SETFLAG(v, FLAG(Z), ISZERO(v->regs[0]));
-            SETFLAG(v, FLAG(N), ISNEG(v->regs[0]));
+    }
+    return reg;
+}
+
+// Replaces the fused sequences of the n decoded ops and sets the retired
+// counts, returns the new op count
+static uint32_t tc_fuse(decoded_op *ops, uint32_t n) {
+    uint32_t out = 0;
+    uint32_t retired = 0;
+    for (uint32_t i = 0; i < n;) {
+        decoded_op op = ops[i];
+        uint32_t count = 1;
+        for (uint32_t s = 0; s < sizeof(fused_seqs) / sizeof(fused_seqs[0]); s++) {
+            int reg = fused_match(&fused_seqs[s], &ops[i], n - i);
+            if (reg < 0) continue;
+            count = fused_seqs[s].count;
+            op.exec = fused_seqs[s].exec;
+            op.raw = reg;
+            op.last = ops[i + count - 1].last;
             break;
         }
-        case AND: {
-            v->regs[0] &= fetch_operand(v, mode); 
-            SETFLAG(v, FLAG(Z), ISZERO(v->regs[0]));
-            SETFLAG(v, FLAG(N), ISNEG(v->regs[0]));
-            break;
+        retired += count;
+        op.retired = retired;
+        ops[out++] = op;
+        i += count;
+    }
+    return out;
+}
+
+static void tc_flush(translation_cache *tc) {
+    for (uint32_t i = 0; i <= TC_ROM_END; i++) tc->index[i] = 0;
+    for (uint32_t i = 0; i < sizeof(tc->code_map); i++) tc->code_map[i] = 0;
+    tc->block_count = 0;
+    tc->op_count = 0;
+    tc->jit_used = 0;
+}
+
+static void tc_reserve(translation_cache *tc) {
+    if (!tc->index) {
+        tc->index = calloc(TC_ROM_END + 1, sizeof(uint16_t));
+        ASSERT(tc->index != NULL);
+    }
+    if (tc->op_count + TC_MAX_BLOCK > TC_MAX_OPS || tc->block_count > TC_ROM_END) {
+        tc_flush(tc);
+    }
+    if (tc->op_count + TC_MAX_BLOCK > tc->op_cap) {
+        tc->op_cap = tc->op_cap ? tc->op_cap * 2 : 1024;
+        tc->ops = realloc(tc->ops, tc->op_cap * sizeof(decoded_op));
+        ASSERT(tc->ops != NULL);
+    }
+    if (tc->block_count == tc->block_cap) {
+        tc->block_cap = tc->block_cap ? tc->block_cap * 2 : 128;
+        tc->blocks = realloc(tc->blocks, tc->block_cap * sizeof(tc_block));
+        ASSERT(tc->blocks != NULL);
+    }
+}
+
+// Decodes the basic block starting at pc, returns its number + 1 or 0
+// when not even the first instruction fits in the fixed bank
+static uint16_t tc_translate(vm *v, uint16_t pc) {
+    translation_cache *tc = &v->tc;
+    tc_reserve(tc);
+
+    decoded_op *ops = &tc->ops[tc->op_count];
+    uint32_t n = 0;
+    uint32_t addr = pc;
+    while (n < TC_MAX_BLOCK && addr <= TC_ROM_END) {
+        uint8_t value = mem_read(v, addr);
+        const inst_info *info = &inst_table[value];
+        uint32_t last = addr + info->length - 1;
+        if (last > TC_ROM_END) break;
+
+        ops[n].exec = info->exec;
+        ops[n].last = last;
+        ops[n].value = value;
+        switch (info->length) {
+            case 1: ops[n].raw = 0; break;
+            case 2: ops[n].raw = mem_read(v, addr + 1); break;
+            case 3: ops[n].raw = mem_read(v, addr + 1) << 8 | mem_read(v, addr + 2); break;
+        }
+        n++;
+        addr = last + 1;
+        if (ends_block(value)) break;
+    }
+    if (n == 0) return 0;
+    n = tc_fuse(ops, n);
+
+    for (uint32_t i = pc; i < addr; i++) tc->code_map[i >> 3] |= 1 << (i & 7);
+    tc->blocks[tc->block_count] = (tc_block){ pc, addr - 1, tc->op_count, n, 0, NULL };
+    tc->block_count++;
+    tc->op_count += n;
+    tc->index[pc] = tc->block_count;
+    return tc->block_count;
+}
+
+// Drops every block covering addr after a write in the fixed bank
+void tc_invalidate(vm *v, uint16_t addr) {
+    translation_cache *tc = &v->tc;
+    if (!(tc->code_map[addr >> 3] & (1 << (addr & 7)))) return;
+    for (uint32_t i = 0; i < tc->block_count; i++) {
+        tc_block *b = &tc->blocks[i];
+        if (addr >= b->start && addr <= b->end && tc->index[b->start] == i + 1) {
+            tc->index[b->start] = 0;
         }
+    }
+    v->break_block = true;
+}
+
+// x86-64 JIT for hot blocks of the fixed bank.
+// Blocks entered JIT_THRESHOLD times are compiled from their decoded_op
+// list. Guest registers, flags and SP are never cached in host registers:
+// compiled code reads and writes them in the vm struct, so the vm is
+// always coherent. PC is only written before calling back into an exec_*
+// handler and when leaving the block. Instructions without a native
+// translation call their exec_* handler.
+#define JIT_THRESHOLD  1000
+#define JIT_CODE_SIZE  (1 << 20)
+#define JIT_MAX_OP     64 // Upper bound of native bytes per instruction
+
+#if defined(__x86_64__)
+#define VM_OFF(field) ((int32_t)offsetof(vm, field))
+#define REG_OFF(n) (VM_OFF(regs) + (n))
+
+typedef struct {
+    uint8_t *code;
+    uint32_t len;
+} jit_emitter;
+
+static void emit8(jit_emitter *e, uint8_t b) { e->code[e->len++] = b; }
+static void emit16(jit_emitter *e, uint16_t w) { memcpy(&e->code[e->len], &w, 2); e->len += 2; }
+static void emit32(jit_emitter *e, uint32_t d) { memcpy(&e->code[e->len], &d, 4); e->len += 4; }
+static void emit64(jit_emitter *e, uint64_t q) { memcpy(&e->code[e->len], &q, 8); e->len += 8; }
+
+// <op> [rbx + disp32] with the ModRM reg field set to reg
+static void emit_rbx(jit_emitter *e, uint8_t op, uint8_t reg, int32_t disp) {
+    emit8(e, op);
+    emit8(e, 0x80 | reg << 3 | 3);
+    emit32(e, disp);
+}
+
+static void emit_load_al(jit_emitter *e, int32_t disp) { emit_rbx(e, 0x8A, 0, disp); }
+static void emit_store_al(jit_emitter *e, int32_t disp) { emit_rbx(e, 0x88, 0, disp); }
+static void emit_store_imm8(jit_emitter *e, int32_t disp, uint8_t imm) { emit_rbx(e, 0xC6, 0, disp); emit8(e, imm); }
+
+static void emit_set_pc(jit_emitter *e, uint16_t pc) {
+    emit8(e, 0x66);
+    emit_rbx(e, 0xC7, 0, VM_OFF(pc));
+    emit16(e, pc);
+}
+
+static void emit_epilogue(jit_emitter *e) {
+    emit8(e, 0x5B); // pop rbx
+    emit8(e, 0xC3); // ret
+}
+
+// Leaves the block after its first n instructions
+static void emit_exit(jit_emitter *e, uint32_t n) {
+    emit8(e, 0x48); emit_rbx(e, 0x81, 0, VM_OFF(instret)); emit32(e, n); // add [instret], n
+    emit_epilogue(e);
+}
+
+// Same flag updates as SET_ZN, from the result in al.
+// keep is the mask of flags left untouched (ADD also clears C).
+static void emit_set_zn(jit_emitter *e, uint8_t keep) {
+    emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xC8);             // movzx ecx, al
+    emit8(e, 0xC1); emit8(e, 0xE9); emit8(e, 7);                // shr ecx, 7
+    emit8(e, 0xC1); emit8(e, 0xE1); emit8(e, 4);                // shl ecx, 4
+    emit8(e, 0x84); emit8(e, 0xC0);                             // test al, al
+    emit8(e, 0x0F); emit8(e, 0x94); emit8(e, 0xC2);             // sete dl
+    emit8(e, 0x00); emit8(e, 0xD2);                             // add dl, dl
+    emit8(e, 0x08); emit8(e, 0xD1);                             // or cl, dl
+    emit_rbx(e, 0x80, 4, VM_OFF(flags)); emit8(e, keep);        // and [flags], keep
+    emit_rbx(e, 0x08, 1, VM_OFF(flags));                        // or [flags], cl
+}
+
+// Loads the operand of an ALU instruction and applies it to al with the
+// "op al, imm8" / "op al, [rbx + disp32]" encodings, false if the mode
+// has no native translation
+static bool emit_alu(jit_emitter *e, uint8_t imm_op, uint8_t mem_op, uint8_t mode, uint16_t raw) {
+    switch (mode) {
+        case 0: emit8(e, imm_op); emit8(e, raw & 0xFF); return true;
+        case 2:
+            if (raw >= REG_COUNT) return false;
+            emit_rbx(e, mem_op, 0, REG_OFF(raw));
+            return true;
+        default: return false;
+    }
+}
+
+// Native translation of a single instruction, false to call the handler
+static bool jit_native_op(jit_emitter *e, const decoded_op *op) {
+    uint8_t opcode = op->value & OPCODE_MASK;
+    uint8_t mode = op->value >> 5;
+    uint16_t raw = op->raw;
+    uint32_t start = e->len;
+
+    switch (opcode) {
+        case NOOP: return true;
+        case LDA:
+            if (mode == 0 || mode == 3) { emit_store_imm8(e, REG_OFF(0), raw & 0xFF); return true; }
+            if (mode == 2 && raw < REG_COUNT) {
+                emit_load_al(e, REG_OFF(raw));
+                emit_store_al(e, REG_OFF(0));
+                return true;
+            }
+            return false;
+        case SAR:
+            if (mode != 0 || raw >= REG_COUNT) return false;
+            emit_load_al(e, REG_OFF(0));
+            emit_store_al(e, REG_OFF(raw));
+            return true;
+        case CMP:
+            emit_load_al(e, REG_OFF(0));
+            if (!emit_alu(e, 0x3C, 0x3A, mode, raw)) break;      // cmp al, x
+            emit8(e, 0x0F); emit8(e, 0x94); emit8(e, 0xC0);      // sete al
+            emit_rbx(e, 0x80, 4, VM_OFF(flags)); emit8(e, (uint8_t)~FLAG(Z));
+            emit_rbx(e, 0x08, 0, VM_OFF(flags));                 // or [flags], al
+            return true;
+        case ADD:
+        case AND:
         case OR: {
-            v->regs[0] |= fetch_operand(v, mode); 
-            SETFLAG(v, FLAG(Z), ISZERO(v->regs[0]));
-            SETFLAG(v, FLAG(N), ISNEG(v->regs[0]));
-            break;
+            static const uint8_t imm_ops[] = { [ADD] = 0x04, [AND] = 0x24, [OR] = 0x0C };
+            static const uint8_t mem_ops[] = { [ADD] = 0x02, [AND] = 0x22, [OR] = 0x0A };
+            emit_load_al(e, REG_OFF(0));
+            if (!emit_alu(e, imm_ops[opcode], mem_ops[opcode], mode, raw)) break;
+            emit_store_al(e, REG_OFF(0));
+            emit_set_zn(e, opcode == ADD ? 0xF8 : 0xFA);
+            return true;
         }
-        case NOT: {
-            v->regs[0] = ~v->regs[0]; 
-            SETFLAG(v, FLAG(Z), ISZERO(v->regs[0]));
-            SETFLAG(v, FLAG(N), ISNEG(v->regs[0]));
-            break;
+        case NOT:
+            emit_load_al(e, REG_OFF(0));
+            emit8(e, 0xF6); emit8(e, 0xD0);                     // not al
+            emit_store_al(e, REG_OFF(0));
+            emit_set_zn(e, 0xFA);
+            return true;
+    }
+    e->len = start;
+    return false;
+}
+
+// Fused sequences that only touch registers are compiled instruction by
+// instruction
+static bool jit_fused_native(jit_emitter *e, const decoded_op *op) {
+    decoded_op parts[] = {
+        { .value = LDA | 2 << 5, .raw = op->raw },
+        { .value = ADD, .raw = 1 },
+        { .value = SAR, .raw = op->raw },
+    };
+    if (op->exec == exec_incr_carry) parts[1] = (decoded_op){ .value = ADD | 6 << 5 };
+    else if (op->exec != exec_incr) return false;
+
+    uint32_t start = e->len;
+    for (uint32_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (!jit_native_op(e, &parts[i])) {
+            e->len = start;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void jit_call_handler(jit_emitter *e, const decoded_op *op) {
+    emit_set_pc(e, op->last);
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF);             // mov rdi, rbx
+    emit8(e, 0xBE); emit32(e, op->raw);                         // mov esi, raw
+    emit8(e, 0x48); emit8(e, 0xB8); emit64(e, (uint64_t)(uintptr_t)op->exec); // mov rax, exec
+    emit8(e, 0xFF); emit8(e, 0xD0);                             // call rax
+}
+
+// Conditional jumps leave the block with PC on the target or on the next
+// instruction
+static void jit_jump(jit_emitter *e, const decoded_op *op, uint32_t n) {
+    uint8_t mode = op->value >> 5;
+    uint16_t target = op->raw;
+    uint16_t next = op->last + 1;
+    if (mode == 0) {
+        emit_set_pc(e, target);
+        return;
+    }
+    emit_rbx(e, 0xF6, 0, VM_OFF(flags)); emit8(e, FLAG(Z));     // test [flags], Z
+    emit8(e, 0x0F); emit8(e, mode == 1 ? 0x84 : 0x85);          // jz/jnz not_taken
+    uint32_t patch = e->len;
+    emit32(e, 0);
+    emit_set_pc(e, target);
+    emit_exit(e, n);
+    int32_t rel = e->len - (patch + 4);
+    memcpy(&e->code[patch], &rel, 4);
+    emit_set_pc(e, next);
+}
+
+static void jit_compile(vm *v, tc_block *b) {
+    translation_cache *tc = &v->tc;
+    if (!tc->jit_code) {
+        void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+            tc->jit_enabled = false;
+            return;
+        }
+        tc->jit_code = code;
+    }
+    if (tc->jit_used + (b->op_count + 2) * JIT_MAX_OP > JIT_CODE_SIZE) return;
+
+    jit_emitter e = { tc->jit_code + tc->jit_used, 0 };
+    emit8(&e, 0x53);                                            // push rbx
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xFB);          // mov rbx, rdi
+
+    const decoded_op *ops = &tc->ops[b->first_op];
+    bool left = false;
+    uint32_t i;
+    for (i = 0; i < b->op_count; i++) {
+        const decoded_op *op = &ops[i];
+        uint8_t opcode = op->value & OPCODE_MASK;
+        uint8_t mode = op->value >> 5;
+
+        if (op->exec != inst_table[op->value].exec) {
+            if (jit_fused_native(&e, op)) continue;
+            // Fused sequence, its slow path may stop early on a refresh
+            // and leaves PC on the last instruction it ran
+            jit_call_handler(&e, op);
+            emit_rbx(&e, 0x80, 7, VM_OFF(break_block)); emit8(&e, 0);   // cmp [break_block], 0
+            emit8(&e, 0x74); emit8(&e, 0);                               // je continue
+            uint32_t patch = e.len;
+            emit8(&e, 0x66); emit_rbx(&e, 0x83, 0, VM_OFF(pc)); emit8(&e, 1); // add [pc], 1
+            emit_exit(&e, op->retired);
+            e.code[patch - 1] = e.len - patch;
+            continue;
         }
-        case SHR: {
-            v->regs[0] = (v->regs[0] >> fetch_operand(v, mode)); 
-            SETFLAG(v, FLAG(Z), ISZERO(v->regs[0]));
-            SETFLAG(v, FLAG(N), ISNEG(v->regs[0]));
+        if (opcode == JMP && mode <= 2) {
+            jit_jump(&e, op, op->retired);
+            i++;
+            left = true;
             break;
         }
-        case SHL: {
-            v->regs[0] = (v ->regs[0] << fetch_operand(v, mode)); 
-            SETFLAG(v, FLAG(Z), ISZERO(v->regs[0]));
-            SETFLAG(v, FLAG(N), ISNEG(v->regs[0]));
+        if (jit_native_op(&e, op)) continue;
+
+        jit_call_handler(&e, op);
+        if (ends_block(op->value)) {
+            // The handler moved PC itself, step past it like vm_step
+            emit8(&e, 0x66); emit_rbx(&e, 0x83, 0, VM_OFF(pc)); emit8(&e, 1); // add [pc], 1
+            i++;
+            left = true;
             break;
         }
-        // Unknown
-        default: ABORT("Unkown upcode"); break;
+        if (opcode == SAM || opcode == PSH) {
+            // Refresh request or write over translated code
+            emit_rbx(&e, 0x80, 7, VM_OFF(break_block)); emit8(&e, 0);   // cmp [break_block], 0
+            emit8(&e, 0x74); emit8(&e, 0);                               // je continue
+            uint32_t patch = e.len;
+            emit_set_pc(&e, op->last + 1);
+            emit_exit(&e, op->retired);
+            e.code[patch - 1] = e.len - patch;
+        }
     }
+    if (!left) emit_set_pc(&e, b->end + 1);
+    emit_exit(&e, i ? ops[i - 1].retired : 0);
+
+    tc->jit_used += (e.len + 15) & ~15u;
+    b->native = (jit_block)(void *)e.code;
 }
+#else
+static void jit_compile(vm *v, tc_block *b) { (void)b; v->tc.jit_enabled = false; }
+#endif
 
-Color colors[] = {
-    {0x1D, 0x1D, 0x1D, 0xFF},
-    {0xFF, 0xFF, 0xFF, 0xFF},
-    {0xF5, 0xE9, 0xBE, 0xFF},
-    {0x9A, 0x6A, 0xCB, 0xFF},
-    {0x4A, 0x90, 0xB8, 0xFF},
-    {0x5C, 0xAD, 0x4A, 0xFF},
-    {0xB8, 0x4A, 0x4A, 0xFF},
-    {0x7D, 0x7D, 0x7D, 0xFF}
-};
+static void tc_run(vm *v, tc_block *b) {
+    v->break_block = false;
+    if (v->tc.jit_enabled) {
+        if (b->native) {
+            b->native(v);
+            return;
+        }
+        if (++b->hits == JIT_THRESHOLD) jit_compile(v, b);
+    }
 
-const int COLOR_COUNT = sizeof(colors) / sizeof(colors[0]);
+    const decoded_op *start = &v->tc.ops[b->first_op];
+    const decoded_op *end = start + b->op_count;
+    const decoded_op *op = start;
+    do {
+        v->pc = op->last;
+        op->exec(v, op->raw);
+    } while (++op < end && !v->break_block);
+    v->instret += op[-1].retired;
+    advance_pc(v);
+}
 
-void render_game(vm *v) {
-    // Render background
-    uint8_t x_scrolling = mem_read(v, 0x8001) % 8;
-    uint8_t y_scrolling = mem_read(v, 0x8002) / 8;
-    
-    for (int i = 0; i < (17 * 9) * 3; i += 3) {
-        uint8_t tile_index = mem_read(v, 0xD100 + i);
-        uint8_t x = mem_read(v, 0xD100 + i + 1);
-        uint8_t y = mem_read(v, 0xD100 + i + 2);
-
-        uint16_t tile_addr = 0xA100 + tile_index * 24;
-
-        size_t total_bits = 24 * 8;
-        size_t num_windows = total_bits / 3;
-
-        for (size_t i = 0; i < num_windows; i++) {
-            uint16_t bit_index = i * 3;
-            size_t byte_index = bit_index / 8;
-            size_t bit_offset = bit_index % 8;
-
-            uint16_t combined = 0;
-            if (byte_index < 24) {
-                combined |= mem_read(v, tile_addr + byte_index); 
-            }
-            if (byte_index + 1 < 24) {
-                combined |= ((uint16_t)mem_read(v, tile_addr + byte_index + 1)) << 8;
-            }
+static void tc_run_traced(vm *v, tc_block *b);
+static void trace_step(vm *v);
 
-            uint8_t pixel =  (combined >> bit_offset) & 0x07;
-            uint8_t offset_x = i % 8;
-            uint8_t offset_y = i / 8;
+// Runs the block starting at PC and moves PC past it, returns false when
+// PC can't be translated
+static bool tc_exec(vm *v) {
+    uint16_t block = v->tc.index ? v->tc.index[v->pc] : 0;
+    if (!block && !(block = tc_translate(v, v->pc))) return false;
 
-            uint16_t final_x = x * 8 + offset_x - x_scrolling;
-            uint16_t final_y = y * 8 + offset_y - y_scrolling;
-            if (final_x >= 128 || final_y >= 64) {
-                continue;
-            }
-            uint16_t gpu_addr = final_x + y * 128 * 8 + (offset_y - y_scrolling) * 128;
-            v->gpu_memory[gpu_addr] = pixel;
+    if (v->trace) tc_run_traced(v, &v->tc.blocks[block - 1]);
+    else tc_run(v, &v->tc.blocks[block - 1]);
+    return true;
+}
+
+void vm_free(vm *v) {
+    if (v->rom_copies) {
+        for (uint32_t i = 0; i < v->cart->header.rom_bank_count * ROM_BANK_PAGES; i++) {
+            free(v->rom_copies[i]);
         }
+        free(v->rom_copies);
+        v->rom_copies = NULL;
     }
+    free(v->tc.index);
+    free(v->tc.blocks);
+    free(v->tc.ops);
+#if defined(__x86_64__)
+    if (v->tc.jit_code) munmap(v->tc.jit_code, JIT_CODE_SIZE);
+#endif
+    v->tc = (translation_cache){ .jit_enabled = v->tc.jit_enabled };
+}
 
-    for (uint32_t i = 0; i < GPU_MEMORY; i++) {
-        int x = (i % 128);
-        int y = (i / 128);
-        uint8_t value = v->gpu_memory[i];
-        DrawRectangle(x * 8, y * 8, 8, 8, colors[value % COLOR_COUNT]);
+void vm_step(vm *v) {
+    if (v->pc <= TC_ROM_END && tc_exec(v)) return;
+    if (v->trace) {
+        trace_step(v);
+        return;
     }
+    vm_exec_opcode(v);
+    advance_pc(v);
+    v->instret++;
 }
 
-// Inputs are encoding into a single byte
-// 0 -> A Button
-// 1 -> B Button
-// 2 -> Up Pad
-// 3 -> Right Pad
-// 4 -> Down Pad
-// 5 -> Left Pad
-// 6 -> Select
-// 7 -> Start
-void refresh_input(vm *v) {
-    uint8_t key_press = 0
-        | IsKeyDown(KEY_J) << 0
-        | IsKeyDown(KEY_K) << 1
-        | IsKeyDown(KEY_W) << 2
-        | IsKeyDown(KEY_D) << 3
-        | IsKeyDown(KEY_S) << 4
-        | IsKeyDown(KEY_A) << 5
-        | IsKeyDown(KEY_E) << 7
-        | IsKeyDown(KEY_R) << 7;
-    mem_write(v, 0x8005, key_press);
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void vm_run(vm *v) {
-    while (!WindowShouldClose()) {
-        vm_exec_opcode(v);
-        advance_pc(v);
-        if (mem_read(v, 0x8000) == 1) {
-            mem_write(v, 0x8000, 0);
-            for (uint16_t i = 0; i < GPU_MEMORY; i++) v->gpu_memory[i] = 0;
-            BeginDrawing();
-                ClearBackground(BLACK);
-                render_game(v);
-                refresh_input(v);
-            EndDrawing();
-        }
-    }
-}
+// Profiler: counts executions per guest PC and per instruction byte by
+// single stepping the interpreter, and splits host time between
+// interpretation, render_game and presenting the frame. The run loops only
+// look at it when it is enabled.
+typedef struct {
+    uint64_t pc_counts[0x10000];
+    // Start of the straight-line run each PC was last executed in, used as
+    // the parent frame of the PC in collapsed stacks
+    uint16_t runs[0x10000];
+    uint64_t value_counts[256];
+    uint16_t run;
+    double interp_time;
+    double render_time;
+    double present_time;
+    double mark;
+} profiler;
 
-int main() {
-    InitWindow(1024, 512, "8bit-console");
-    SetTargetFPS(60);
+#define OPCODE_NAME(op) [op] = #op,
+static const char *const opcode_names[32] = { OPCODE_LIST(OPCODE_NAME) };
+static const char *const mode_names[8] = { "$x", "#x", "@x", "$x,y", "#x,y", "@x,y", "@C", "@PC" };
+
+static void format_instruction(char *buf, size_t size, uint8_t value) {
+    static const char *const jumps[8] = { "JAL", "JEQ", "JNE" };
+    const char *name = opcode_names[value & OPCODE_MASK];
+    uint8_t opcode = value & OPCODE_MASK;
+    if (value == 0xFF) snprintf(buf, size, "HALT");
+    else if (!name) snprintf(buf, size, "?%02x", value);
+    else if (opcode == JMP && jumps[value >> 5]) snprintf(buf, size, "%s", jumps[value >> 5]);
+    else if (opcode == NOOP || opcode == NOT) snprintf(buf, size, "%s", name);
+    else snprintf(buf, size, "%s %s", name, mode_names[value >> 5]);
+}
+
+// Binary trace: the emulation thread appends fixed-size records to a
+// single producer, single consumer ring that a background thread flushes
+// to disk. When the ring is full records are dropped rather than stalling
+// the guest, and a gap record with the number of lost records is written
+// once there is room again. The file is an 8 bytes header, "8BTR" then
+// the version and the record size as 16 bits little-endian integers,
+// followed by the records. trace.py decodes it.
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE (1 << 20) // Records, a power of two
+
+enum { TRACE_INSTRUCTION, TRACE_GAP };
+
+typedef struct {
+    uint16_t pc;
+    uint8_t value;      // Instruction byte
+    uint8_t operand[2]; // Operand bytes, 0 when not consumed
+    uint8_t r0;         // r0 and flags once the instruction ran
+    uint8_t flags;
+    uint8_t kind;       // For TRACE_GAP the first 4 bytes hold the count
+} trace_record;
+
+_Static_assert(sizeof(trace_record) == 8, "trace records are 8 bytes");
+
+struct tracer {
+    trace_record *ring;
+    _Alignas(64) _Atomic uint64_t head; // Next record pushed by the emulation thread
+    uint64_t tail_cache;                // Last tail seen by the emulation thread
+    uint64_t dropped;                   // Records lost since the last gap record
+    uint64_t total_dropped;
+    _Alignas(64) _Atomic uint64_t tail; // Next record written by the flush thread
+    _Atomic bool stop;
+    FILE *file;
+    pthread_t thread;
+};
+
+static bool trace_reserve(tracer *t, uint64_t head, uint64_t n) {
+    if (head + n - t->tail_cache <= TRACE_RING_SIZE) return true;
+    t->tail_cache = atomic_load_explicit(&t->tail, memory_order_acquire);
+    return head + n - t->tail_cache <= TRACE_RING_SIZE;
+}
+
+static void trace_push(tracer *t, const trace_record *r) {
+    uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    if (!trace_reserve(t, head, t->dropped ? 2 : 1)) {
+        t->dropped++;
+        t->total_dropped++;
+        return;
+    }
+    if (t->dropped) {
+        trace_record gap = { .kind = TRACE_GAP };
+        uint32_t count = t->dropped > UINT32_MAX ? UINT32_MAX : t->dropped;
+        memcpy(&gap, &count, sizeof(count));
+        t->ring[head++ & (TRACE_RING_SIZE - 1)] = gap;
+        t->dropped = 0;
+    }
+    t->ring[head++ & (TRACE_RING_SIZE - 1)] = *r;
+    atomic_store_explicit(&t->head, head, memory_order_release);
+}
+
+static void *trace_flush_main(void *arg) {
+    tracer *t = arg;
+    for (;;) {
+        // Read stop first so every record pushed before it is written
+        bool stop = atomic_load(&t->stop);
+        uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+        while (tail != head) {
+            uint64_t start = tail & (TRACE_RING_SIZE - 1);
+            uint64_t n = head - tail;
+            if (n > TRACE_RING_SIZE - start) n = TRACE_RING_SIZE - start;
+            fwrite(&t->ring[start], sizeof(trace_record), n, t->file);
+            tail += n;
+            atomic_store_explicit(&t->tail, tail, memory_order_release);
+        }
+        if (stop) return NULL;
+        nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+    }
+}
+
+tracer *trace_open(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return NULL;
+    }
+    static const uint8_t header[8] = { '8', 'B', 'T', 'R', TRACE_VERSION, 0, sizeof(trace_record), 0 };
+    fwrite(header, 1, sizeof(header), f);
+
+    tracer *t = calloc(1, sizeof(tracer));
+    ASSERT(t != NULL);
+    t->ring = malloc(TRACE_RING_SIZE * sizeof(trace_record));
+    ASSERT(t->ring != NULL);
+    t->file = f;
+    ASSERT(pthread_create(&t->thread, NULL, trace_flush_main, t) == 0);
+    return t;
+}
+
+void trace_close(tracer *t) {
+    atomic_store(&t->stop, true);
+    pthread_join(t->thread, NULL);
+    if (t->dropped) {
+        trace_record gap = { .kind = TRACE_GAP };
+        uint32_t count = t->dropped > UINT32_MAX ? UINT32_MAX : t->dropped;
+        memcpy(&gap, &count, sizeof(count));
+        fwrite(&gap, sizeof(gap), 1, t->file);
+    }
+    fclose(t->file);
+    fprintf(stderr, "trace: %llu records written, %llu dropped\n",
+            (unsigned long long)atomic_load(&t->head), (unsigned long long)t->total_dropped);
+    free(t->ring);
+    free(t);
+}
+
+// Single step used while profiling or tracing, either may be NULL
+void instrumented_step(vm *v, profiler *p, tracer *t) {
+    uint16_t pc = v->pc;
+    uint8_t value = mem_read(v, pc);
+    uint8_t length = inst_table[value].length;
+    if (p) {
+        p->pc_counts[pc]++;
+        p->value_counts[value]++;
+        p->runs[pc] = p->run;
+    }
+    trace_record r = { .pc = pc, .value = value };
+    if (t) {
+        if (length > 1) r.operand[0] = mem_read(v, pc + 1);
+        if (length > 2) r.operand[1] = mem_read(v, pc + 2);
+    }
+    vm_exec_opcode(v);
+    advance_pc(v);
+    v->instret++;
+    if (p && v->pc != (uint16_t)(pc + length)) p->run = v->pc;
+    if (t) {
+        r.r0 = v->regs[0];
+        r.flags = v->flags;
+        trace_push(t, &r);
+    }
+}
+
+static void trace_step(vm *v) {
+    instrumented_step(v, NULL, v->trace);
+}
+
+// Runs the instruction at PC from its already fetched bytes and records it
+static void trace_exec(vm *v, uint8_t value, uint16_t raw) {
+    const inst_info *info = &inst_table[value];
+    trace_record r = { .pc = v->pc, .value = value };
+    switch (info->length) {
+        case 2: r.operand[0] = raw; break;
+        case 3: r.operand[0] = raw >> 8; r.operand[1] = raw; break;
+    }
+    v->pc += info->length - 1;
+    info->exec(v, raw);
+    advance_pc(v);
+    v->instret++;
+    r.r0 = v->regs[0];
+    r.flags = v->flags;
+    trace_push(v->trace, &r);
+}
+
+// Traced blocks run from their decoded ops, never from JIT code, and
+// record every instruction. The ops always match the code in memory since
+// writes over it drop the block. Fused ops are split back into the
+// instructions of their sequence.
+static void tc_run_traced(vm *v, tc_block *b) {
+    v->break_block = false;
+    const decoded_op *op = &v->tc.ops[b->first_op];
+    const decoded_op *end = op + b->op_count;
+    for (; op < end && !v->break_block; op++) {
+        if (op->exec == inst_table[op->value].exec) {
+            trace_exec(v, op->value, op->raw);
+            continue;
+        }
+        const fused_seq *seq = fused_seqs;
+        while (seq->exec != op->exec) seq++;
+        for (uint32_t i = 0; i < seq->count && !v->break_block; i++) {
+            trace_exec(v, seq->values[i], seq->raws[i] == FUSED_REG ? op->raw : seq->raws[i]);
+        }
+    }
+}
+
+// Adds the time since the last lap to bucket
+static void profile_lap(profiler *p, double *bucket) {
+    double now = now_seconds();
+    *bucket += now - p->mark;
+    p->mark = now;
+}
+
+typedef struct {
+    uint32_t key;
+    uint64_t count;
+} profile_entry;
+
+static int profile_entry_cmp(const void *a, const void *b) {
+    const profile_entry *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// Sorted report of the time split and the opcode, mode and PC histograms
+void profile_report(profiler *p, vm *v, FILE *out) {
+    uint64_t total = 0;
+    uint64_t opcodes[33] = {};
+    uint64_t modes[8] = {};
+    for (uint32_t i = 0; i < 256; i++) {
+        total += p->value_counts[i];
+        opcodes[i == 0xFF ? 32 : i & OPCODE_MASK] += p->value_counts[i];
+        if (i != 0xFF) modes[i >> 5] += p->value_counts[i];
+    }
+    if (!total) total = 1;
+    double time = p->interp_time + p->render_time + p->present_time;
+    if (time == 0) time = 1;
+    fprintf(out, "Host time: interpret %.3fs (%.1f%%), render_game %.3fs (%.1f%%), present %.3fs (%.1f%%)\n",
+            p->interp_time, 100 * p->interp_time / time, p->render_time, 100 * p->render_time / time,
+            p->present_time, 100 * p->present_time / time);
+
+    profile_entry entries[33];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < 33; i++) {
+        if (opcodes[i]) entries[n++] = (profile_entry){ i, opcodes[i] };
+    }
+    qsort(entries, n, sizeof(profile_entry), profile_entry_cmp);
+    fprintf(out, "\nOpcodes:\n");
+    for (uint32_t i = 0; i < n; i++) {
+        const char *name = entries[i].key == 32 ? "HALT" : opcode_names[entries[i].key];
+        fprintf(out, "  %-6s %12llu %5.1f%%\n", name ? name : "?",
+                (unsigned long long)entries[i].count, 100.0 * entries[i].count / total);
+    }
+
+    n = 0;
+    for (uint32_t i = 0; i < 8; i++) {
+        if (modes[i]) entries[n++] = (profile_entry){ i, modes[i] };
+    }
+    qsort(entries, n, sizeof(profile_entry), profile_entry_cmp);
+    fprintf(out, "\nAddressing modes:\n");
+    for (uint32_t i = 0; i < n; i++) {
+        fprintf(out, "  %-6s %12llu %5.1f%%\n", mode_names[entries[i].key],
+                (unsigned long long)entries[i].count, 100.0 * entries[i].count / total);
+    }
+
+    profile_entry *pcs = malloc(0x10000 * sizeof(profile_entry));
+    ASSERT(pcs != NULL);
+    n = 0;
+    for (uint32_t pc = 0; pc < 0x10000; pc++) {
+        if (p->pc_counts[pc]) pcs[n++] = (profile_entry){ pc, p->pc_counts[pc] };
+    }
+    qsort(pcs, n, sizeof(profile_entry), profile_entry_cmp);
+    fprintf(out, "\nHot PCs (%u executed):\n", n);
+    for (uint32_t i = 0; i < n && i < 32; i++) {
+        char inst[16];
+        format_instruction(inst, sizeof(inst), mem_read(v, pcs[i].key));
+        fprintf(out, "  0x%04x %-10s %12llu %5.1f%%\n", pcs[i].key, inst,
+                (unsigned long long)pcs[i].count, 100.0 * pcs[i].count / total);
+    }
+    free(pcs);
+}
+
+// Collapsed stacks for flamegraph tools, one line per PC weighted by its
+// execution count: guest;<run start>;<pc> <instruction> <count>
+void profile_write_collapsed(profiler *p, vm *v, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return;
+    }
+    for (uint32_t pc = 0; pc < 0x10000; pc++) {
+        if (!p->pc_counts[pc]) continue;
+        char inst[16];
+        format_instruction(inst, sizeof(inst), mem_read(v, pc));
+        fprintf(f, "guest;0x%04x;0x%04x %s %llu\n", p->runs[pc], pc, inst,
+                (unsigned long long)p->pc_counts[pc]);
+    }
+    fclose(f);
+}
+
+static const Color colors[] = {
+    {0x1D, 0x1D, 0x1D, 0xFF},
+    {0xFF, 0xFF, 0xFF, 0xFF},
+    {0xF5, 0xE9, 0xBE, 0xFF},
+    {0x9A, 0x6A, 0xCB, 0xFF},
+    {0x4A, 0x90, 0xB8, 0xFF},
+    {0x5C, 0xAD, 0x4A, 0xFF},
+    {0xB8, 0x4A, 0x4A, 0xFF},
+    {0x7D, 0x7D, 0x7D, 0xFF}
+};
+
+const int COLOR_COUNT = sizeof(colors) / sizeof(colors[0]);
+// The vector kernels index the palette with the low 3 bits
+_Static_assert(sizeof(colors) / sizeof(colors[0]) == 8, "the palette has 8 colors");
+
+// Pixel kernels: unpacking a tile, pixel n being the 3 bits starting at
+// bit 3n of its 24 bytes, and expanding palette indices to colors. Every
+// 3 bytes hold 8 pixels, the vector versions gather the one or two bytes
+// of each pixel in a 16 bit lane with a byte shuffle and shift it into
+// place with a multiply, as there are no per lane 16 bit shifts before
+// AVX-512. The best set the CPU supports is picked at startup.
+typedef struct {
+    const char *name;
+    bool (*supported)(void); // NULL when always supported
+    void (*tile_unpack)(uint8_t *pixels, const uint8_t *tile);
+    void (*palette_expand)(Color *pixels, const uint8_t *indices, uint32_t count);
+} pixel_kernels;
+
+static void tile_unpack_scalar(uint8_t *pixels, const uint8_t *tile) {
+    for (int group = 0; group < 8; group++) {
+        const uint8_t *bytes = &tile[group * 3];
+        uint32_t bits = bytes[0] | bytes[1] << 8 | bytes[2] << 16;
+        for (int i = 0; i < 8; i++) pixels[group * 8 + i] = (bits >> (i * 3)) & 0x07;
+    }
+}
+
+static void palette_expand_scalar(Color *pixels, const uint8_t *indices, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) pixels[i] = colors[indices[i] % COLOR_COUNT];
+}
+
+#if defined(__x86_64__)
+// Shuffle of the 8 pixels of the 3 bytes at b into 16 bit lanes: the byte
+// holding the low bit of the pixel, then the next one for the 2 pixels
+// crossing a byte
+#define TILE_GROUP(b) b, -128, b, -128, b, b + 1, b + 1, -128, b + 1, -128, b + 1, b + 2, b + 2, -128, b + 2, -128
+// 1 << (7 - bit offset of the pixel in its first byte), moving it to bits 7-9
+#define TILE_SHIFTS 128, 16, 2, 64, 8, 1, 32, 4
+
+static bool cpu_has_ssse3(void) { return __builtin_cpu_supports("ssse3"); }
+static bool cpu_has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+
+__attribute__((target("ssse3")))
+static void tile_unpack_ssse3(uint8_t *pixels, const uint8_t *tile) {
+    // Bytes 0-15 hold groups 0-3, bytes 8-23 groups 4-7
+    __m128i low = _mm_loadu_si128((const __m128i *)tile);
+    __m128i high = _mm_loadu_si128((const __m128i *)(tile + 8));
+    const __m128i shuffles[8] = {
+        _mm_setr_epi8(TILE_GROUP(0)), _mm_setr_epi8(TILE_GROUP(3)),
+        _mm_setr_epi8(TILE_GROUP(6)), _mm_setr_epi8(TILE_GROUP(9)),
+        _mm_setr_epi8(TILE_GROUP(4)), _mm_setr_epi8(TILE_GROUP(7)),
+        _mm_setr_epi8(TILE_GROUP(10)), _mm_setr_epi8(TILE_GROUP(13)),
+    };
+    const __m128i shifts = _mm_setr_epi16(TILE_SHIFTS);
+    const __m128i mask = _mm_set1_epi16(0x07);
+    __m128i groups[8];
+    for (int g = 0; g < 8; g++) {
+        __m128i lanes = _mm_shuffle_epi8(g < 4 ? low : high, shuffles[g]);
+        groups[g] = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(lanes, shifts), 7), mask);
+    }
+    for (int g = 0; g < 8; g += 2) {
+        _mm_storeu_si128((__m128i *)&pixels[g * 8], _mm_packus_epi16(groups[g], groups[g + 1]));
+    }
+}
+
+// One shuffle per color channel, then the channels are interleaved
+__attribute__((target("ssse3")))
+static void palette_expand_ssse3(Color *pixels, const uint8_t *indices, uint32_t count) {
+    uint8_t channels[4][16] = {};
+    for (int i = 0; i < 8; i++) {
+        channels[0][i] = colors[i].r;
+        channels[1][i] = colors[i].g;
+        channels[2][i] = colors[i].b;
+        channels[3][i] = colors[i].a;
+    }
+    __m128i r = _mm_loadu_si128((const __m128i *)channels[0]);
+    __m128i g = _mm_loadu_si128((const __m128i *)channels[1]);
+    __m128i b = _mm_loadu_si128((const __m128i *)channels[2]);
+    __m128i a = _mm_loadu_si128((const __m128i *)channels[3]);
+    const __m128i mask = _mm_set1_epi8(0x07);
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i index = _mm_and_si128(_mm_loadu_si128((const __m128i *)&indices[i]), mask);
+        __m128i ri = _mm_shuffle_epi8(r, index), gi = _mm_shuffle_epi8(g, index);
+        __m128i bi = _mm_shuffle_epi8(b, index), ai = _mm_shuffle_epi8(a, index);
+        __m128i rg_low = _mm_unpacklo_epi8(ri, gi), rg_high = _mm_unpackhi_epi8(ri, gi);
+        __m128i ba_low = _mm_unpacklo_epi8(bi, ai), ba_high = _mm_unpackhi_epi8(bi, ai);
+        _mm_storeu_si128((__m128i *)&pixels[i], _mm_unpacklo_epi16(rg_low, ba_low));
+        _mm_storeu_si128((__m128i *)&pixels[i + 4], _mm_unpackhi_epi16(rg_low, ba_low));
+        _mm_storeu_si128((__m128i *)&pixels[i + 8], _mm_unpacklo_epi16(rg_high, ba_high));
+        _mm_storeu_si128((__m128i *)&pixels[i + 12], _mm_unpackhi_epi16(rg_high, ba_high));
+    }
+    palette_expand_scalar(&pixels[i], &indices[i], count - i);
+}
+
+// Both halves at once: groups 0-3 in the low 128 bit lane, 4-7 in the high one
+__attribute__((target("avx2")))
+static void tile_unpack_avx2(uint8_t *pixels, const uint8_t *tile) {
+    __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)tile)),
+                                            _mm_loadu_si128((const __m128i *)(tile + 8)), 1);
+    const __m256i shuffles[4] = {
+        _mm256_setr_epi8(TILE_GROUP(0), TILE_GROUP(4)), _mm256_setr_epi8(TILE_GROUP(3), TILE_GROUP(7)),
+        _mm256_setr_epi8(TILE_GROUP(6), TILE_GROUP(10)), _mm256_setr_epi8(TILE_GROUP(9), TILE_GROUP(13)),
+    };
+    const __m256i shifts = _mm256_setr_epi16(TILE_SHIFTS, TILE_SHIFTS);
+    const __m256i mask = _mm256_set1_epi16(0x07);
+    __m256i groups[4];
+    for (int g = 0; g < 4; g++) {
+        __m256i lanes = _mm256_shuffle_epi8(bytes, shuffles[g]);
+        groups[g] = _mm256_and_si256(_mm256_srli_epi16(_mm256_mullo_epi16(lanes, shifts), 7), mask);
+    }
+    // Pixels 0-15 and 32-47, then 16-31 and 48-63
+    __m256i first = _mm256_packus_epi16(groups[0], groups[1]);
+    __m256i second = _mm256_packus_epi16(groups[2], groups[3]);
+    _mm256_storeu_si256((__m256i *)pixels, _mm256_permute2x128_si256(first, second, 0x20));
+    _mm256_storeu_si256((__m256i *)&pixels[32], _mm256_permute2x128_si256(first, second, 0x31));
+}
+
+// The 8 colors fit a register, vpermd looks them up with the low 3 bits
+// of each index
+__attribute__((target("avx2")))
+static void palette_expand_avx2(Color *pixels, const uint8_t *indices, uint32_t count) {
+    __m256i palette = _mm256_loadu_si256((const __m256i *)colors);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&indices[i]));
+        _mm256_storeu_si256((__m256i *)&pixels[i], _mm256_permutevar8x32_epi32(palette, index));
+    }
+    palette_expand_scalar(&pixels[i], &indices[i], count - i);
+}
+#endif
+
+// Fastest first
+static const pixel_kernels pixel_kernel_sets[] = {
+#if defined(__x86_64__)
+    { "avx2", cpu_has_avx2, tile_unpack_avx2, palette_expand_avx2 },
+    { "ssse3", cpu_has_ssse3, tile_unpack_ssse3, palette_expand_ssse3 },
+#endif
+    { "scalar", NULL, tile_unpack_scalar, palette_expand_scalar },
+};
+
+static const pixel_kernels *active_kernels;
+
+// Before main, so both threads only ever read it
+__attribute__((constructor)) static void pixel_kernels_select(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+#endif
+    active_kernels = pixel_kernel_sets;
+    while (active_kernels->supported && !active_kernels->supported()) active_kernels++;
+}
+
+// Decoded pixels of a background tile
+static const uint8_t *tile_pixels(vm *v, uint8_t index) {
+    tile_cache *c = &v->tiles;
+    if (c->valid[index >> 6] & (1ull << (index & 63))) return c->pixels[index];
+
+    const uint8_t *tile = c->bank ? c->bank + index * TILE_SIZE : NULL;
+    uint8_t bytes[TILE_SIZE];
+    if (!tile) {
+        // No video bank, the reads go through the IO handler
+        for (uint16_t i = 0; i < TILE_SIZE; i++) bytes[i] = mem_read(v, 0xA100 + index * TILE_SIZE + i);
+        tile = bytes;
+    }
+    active_kernels->tile_unpack(c->pixels[index], tile);
+    c->valid[index >> 6] |= 1ull << (index & 63);
+    return c->pixels[index];
+}
+
+// Copies the part of a tile at (left, top) inside the clip rectangle
+// [x0, x1) x [y0, y1) to gpu_memory
+static void draw_tile(vm *v, const uint8_t *pixels, int left, int top, int x0, int y0, int x1, int y1) {
+    int first = left < x0 ? x0 - left : 0;
+    int end = left + 8 > x1 ? x1 - left : 8;
+    int first_row = top < y0 ? y0 - top : 0;
+    int end_row = top + 8 > y1 ? y1 - top : 8;
+    for (int row = first_row; row < end_row; row++) {
+        uint8_t *dst = &v->gpu_memory[(top + row) * 128 + left + first];
+        // Whole rows as one constant size copy, GCC turns variable sizes
+        // into a slow to start rep movs
+        if (end - first == 8) memcpy(dst, &pixels[row * 8], 8);
+        else memcpy(dst, &pixels[row * 8 + first], end - first);
+    }
+}
+
+// Screen cells, 16 columns by 8 rows, covered by a tile map entry. False
+// when it is entirely off screen.
+static bool tile_cells(const uint8_t *entry, uint8_t x_scrolling, uint8_t y_scrolling,
+                       int *cx0, int *cy0, int *cx1, int *cy1) {
+    int left = entry[1] * 8 - x_scrolling;
+    int top = entry[2] * 8 - y_scrolling;
+    if (left >= 128 || left + 8 <= 0 || top >= 64 || top + 8 <= 0) return false;
+    *cx0 = (left < 0 ? 0 : left) / 8;
+    *cx1 = ((left + 8 > 128 ? 128 : left + 8) - 1) / 8;
+    *cy0 = (top < 0 ? 0 : top) / 8;
+    *cy1 = ((top + 8 > 64 ? 64 : top + 8) - 1) / 8;
+    return true;
+}
+
+static uint32_t mark_cells(uint16_t *dirty, const uint8_t *entry, uint8_t x_scrolling, uint8_t y_scrolling) {
+    int cx0, cy0, cx1, cy1;
+    if (!tile_cells(entry, x_scrolling, y_scrolling, &cx0, &cy0, &cx1, &cy1)) return 0;
+    uint32_t marked = 0;
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            marked += !(dirty[cy] & 1 << cx);
+            dirty[cy] |= 1 << cx;
+        }
+    }
+    return marked;
+}
+
+// Draws the background tiles into gpu_memory, clipped to the screen.
+// Returns false when gpu_memory was left as it was, nothing it depends on
+// having changed since the last call.
+bool render_background(vm *v) {
+    background_state *b = &v->background;
+    // The tile map sits in plain gpu_tiles memory and the scroll registers
+    // in system_io, both are compared as they are
+    const uint8_t *map = v->gpu_tiles;
+    uint8_t x_scrolling = v->system_io[0x01] % 8;
+    uint8_t y_scrolling = v->system_io[0x02] / 8;
+
+    bool full = !b->valid || x_scrolling != b->x_scrolling || y_scrolling != b->y_scrolling;
+    if (!full && memcmp(map, b->tile_map, TILE_MAP_SIZE) == 0) return false;
+    uint16_t dirty[8] = {};
+    uint32_t dirty_count = 0;
+    if (!full) {
+        for (int i = 0; i < TILE_MAP_SIZE; i += 3) {
+            if (map[i] == b->tile_map[i] && map[i + 1] == b->tile_map[i + 1] && map[i + 2] == b->tile_map[i + 2]) continue;
+            dirty_count += mark_cells(dirty, &b->tile_map[i], x_scrolling, y_scrolling);
+            dirty_count += mark_cells(dirty, &map[i], x_scrolling, y_scrolling);
+        }
+        if (!dirty_count) {
+            memcpy(b->tile_map, map, TILE_MAP_SIZE);
+            return false;
+        }
+        // Past half the screen cell by cell clipping costs more than it saves
+        full = dirty_count > 64;
+    }
+    memcpy(b->tile_map, map, TILE_MAP_SIZE);
+    b->x_scrolling = x_scrolling;
+    b->y_scrolling = y_scrolling;
+    b->valid = true;
+
+    if (full) {
+        memset(v->gpu_memory, 0, GPU_MEMORY);
+        for (int i = 0; i < TILE_MAP_SIZE; i += 3) {
+            int left = map[i + 1] * 8 - x_scrolling;
+            int top = map[i + 2] * 8 - y_scrolling;
+            if (left >= 128 || left + 8 <= 0 || top >= 64 || top + 8 <= 0) continue;
+            draw_tile(v, tile_pixels(v, map[i]), left, top, 0, 0, 128, 64);
+        }
+        return true;
+    }
+
+    for (int cy = 0; cy < 8; cy++) {
+        for (int cx = 0; cx < 16; cx++) {
+            if (!(dirty[cy] & 1 << cx)) continue;
+            for (int row = 0; row < 8; row++) memset(&v->gpu_memory[(cy * 8 + row) * 128 + cx * 8], 0, 8);
+        }
+    }
+    // Later entries are drawn over earlier ones, cell by cell as well
+    for (int i = 0; i < TILE_MAP_SIZE; i += 3) {
+        int cx0, cy0, cx1, cy1;
+        if (!tile_cells(&map[i], x_scrolling, y_scrolling, &cx0, &cy0, &cx1, &cy1)) continue;
+        uint16_t columns = (2 << cx1) - (1 << cx0);
+        if (!((dirty[cy0] | dirty[cy1]) & columns)) continue;
+        int left = map[i + 1] * 8 - x_scrolling;
+        int top = map[i + 2] * 8 - y_scrolling;
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                if (!(dirty[cy] & 1 << cx)) continue;
+                draw_tile(v, tile_pixels(v, map[i]), left, top, cx * 8, cy * 8, cx * 8 + 8, cy * 8 + 8);
+            }
+        }
+    }
+    return true;
+}
+
+// The window shows frames through a single 128x64 texture: palette
+// indices are expanded to RGBA on the CPU, uploaded with UpdateTexture and
+// drawn scaled 8 times with point filtering.
+#define SCREEN_SCALE 8
+#define SCREEN_REDRAW_PERIOD 0.25 // Seconds
+
+typedef struct {
+    Texture2D texture;
+    Color pixels[GPU_MEMORY];
+} screen;
+
+// Needs the window
+void screen_init(screen *s) {
+    Image image = GenImageColor(128, 64, BLACK);
+    s->texture = LoadTextureFromImage(image);
+    UnloadImage(image);
+    SetTextureFilter(s->texture, TEXTURE_FILTER_POINT);
+}
+
+void screen_free(screen *s) {
+    UnloadTexture(s->texture);
+}
+
+void palette_expand(Color *pixels, const uint8_t *gpu_memory) {
+    active_kernels->palette_expand(pixels, gpu_memory, GPU_MEMORY);
+}
+
+// Makes a frame of palette indices the one screen_draw shows
+void screen_upload(screen *s, const uint8_t *gpu_memory) {
+    palette_expand(s->pixels, gpu_memory);
+    UpdateTexture(s->texture, s->pixels);
+}
+
+// Draws the last uploaded frame, between BeginDrawing and EndDrawing
+void screen_draw(screen *s) {
+    DrawTextureEx(s->texture, (Vector2){ 0, 0 }, 0, SCREEN_SCALE, WHITE);
+}
+
+void render_game(screen *s, vm *v) {
+    render_background(v);
+    screen_upload(s, v->gpu_memory);
+    screen_draw(s);
+}
+
+// Inputs are encoding into a single byte
+// 0 -> A Button
+// 1 -> B Button
+// 2 -> Up Pad
+// 3 -> Right Pad
+// 4 -> Down Pad
+// 5 -> Left Pad
+// 6 -> Select
+// 7 -> Start
+uint8_t read_input(void) {
+    return 0
+        | IsKeyDown(KEY_J) << 0
+        | IsKeyDown(KEY_K) << 1
+        | IsKeyDown(KEY_W) << 2
+        | IsKeyDown(KEY_D) << 3
+        | IsKeyDown(KEY_S) << 4
+        | IsKeyDown(KEY_A) << 5
+        | IsKeyDown(KEY_E) << 7
+        | IsKeyDown(KEY_R) << 7;
+}
+
+// Movies: the input byte written to 0x8005 at each GPU refresh, so a run
+// can be replayed exactly. The file is a movie_header followed by one byte
+// per frame. The cart hash makes sure a movie is replayed on the cart it
+// was recorded with, since anything else diverges.
+#define MOVIE_VERSION 1
+
+typedef struct {
+    char magic[4]; // "8BMV"
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t cart_hash;
+    uint64_t frames;
+} movie_header;
+
+_Static_assert(sizeof(movie_header) == 24, "movie headers are 24 bytes");
+
+typedef struct {
+    FILE *file;      // Recording, NULL when replaying
+    uint8_t *inputs; // Replaying
+    uint64_t frames; // Recorded or available frames
+    uint64_t frame;  // Next frame to replay
+    uint64_t cart_hash;
+} movie;
+
+// FNV-1a over the whole cart file
+uint64_t cart_hash(const cartdridge *cart) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < cart->size; i++) {
+        hash ^= cart->data[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+movie *movie_record(const char *path, const cartdridge *cart) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return NULL;
+    }
+    movie *m = calloc(1, sizeof(movie));
+    ASSERT(m != NULL);
+    m->file = f;
+    m->cart_hash = cart_hash(cart);
+    // The frame count is filled in by movie_close
+    movie_header header = { { '8', 'B', 'M', 'V' }, MOVIE_VERSION, 0, m->cart_hash, 0 };
+    fwrite(&header, sizeof(header), 1, f);
+    return m;
+}
+
+movie *movie_replay(const char *path, const cartdridge *cart) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return NULL;
+    }
+    movie_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "8BMV", 4) != 0
+        || header.version != MOVIE_VERSION) {
+        fprintf(stderr, "%s is not a movie\n", path);
+        fclose(f);
+        return NULL;
+    }
+    if (header.cart_hash != cart_hash(cart)) {
+        fprintf(stderr, "%s was recorded with another cart\n", path);
+        fclose(f);
+        return NULL;
+    }
+    movie *m = calloc(1, sizeof(movie));
+    ASSERT(m != NULL);
+    m->inputs = malloc(header.frames ? header.frames : 1);
+    ASSERT(m->inputs != NULL);
+    m->frames = fread(m->inputs, 1, header.frames, f);
+    m->cart_hash = header.cart_hash;
+    fclose(f);
+    if (m->frames != header.frames) {
+        fprintf(stderr, "%s is truncated: %llu of %llu frames\n", path,
+                (unsigned long long)m->frames, (unsigned long long)header.frames);
+    }
+    return m;
+}
+
+// Input of the next frame: the recorded one while replaying, `input`
+// otherwise or once the movie is over. Recording stores it.
+uint8_t movie_input(movie *m, uint8_t input) {
+    if (m->file) {
+        fputc(input, m->file);
+        m->frames++;
+        return input;
+    }
+    if (m->frame < m->frames) return m->inputs[m->frame++];
+    return input;
+}
+
+// Whether the next frame replays `input`, which is always the case past
+// the end of the movie since the input does not change anymore
+bool movie_next_is(const movie *m, uint8_t input) {
+    return m->file || m->frame >= m->frames || m->inputs[m->frame] == input;
+}
+
+void movie_close(movie *m) {
+    if (m->file) {
+        fseek(m->file, offsetof(movie_header, frames), SEEK_SET);
+        fwrite(&m->frames, sizeof(m->frames), 1, m->file);
+        fclose(m->file);
+        fprintf(stderr, "movie: %llu frames recorded\n", (unsigned long long)m->frames);
+    }
+    free(m->inputs);
+    free(m);
+}
+
+// Everything a frame depends on, up to the CPU registers. gpu_memory is
+// left out since it is redrawn from this at every refresh.
+#define IDLE_STATE_SIZE (offsetof(vm, flags) + sizeof(uint8_t))
+
+// Idle detection: a guest that is back at a refresh in the same state as
+// at the previous one, ROM included, is spinning on its frame loop and
+// will keep producing that frame until its input changes
+typedef struct {
+    uint8_t snapshot[IDLE_STATE_SIZE];
+    uint64_t rom_writes;
+    bool primed;
+    bool idle;
+} idle_tracker;
+
+// Called at each refresh once the input is written
+bool idle_check(idle_tracker *t, vm *v) {
+    t->idle = t->primed && t->rom_writes == v->rom_writes
+        && memcmp(t->snapshot, v, IDLE_STATE_SIZE) == 0;
+    memcpy(t->snapshot, v, IDLE_STATE_SIZE);
+    t->rom_writes = v->rom_writes;
+    t->primed = true;
+    return t->idle;
+}
+
+// Save states: everything the guest can observe, restored in place into
+// a vm of the same cart. ROM pages are kept like vm.rom_copies, only the
+// pages the guest wrote to are stored.
+typedef struct {
+    uint8_t memory[IDLE_STATE_SIZE]; // system_io up to flags
+    uint8_t gpu_memory[GPU_MEMORY];
+    uint64_t instret;
+    uint64_t rom_writes;
+    uint16_t gpu_pointer;
+} state_core;
+
+typedef struct {
+    state_core core;
+    uint8_t **rom_pages; // NULL pages are the cart's
+    uint32_t rom_page_count;
+} save_state;
+
+static uint32_t cart_rom_pages(const cartdridge *cart) {
+    return cart->header.rom_bank_count * ROM_BANK_PAGES;
+}
+
+static void state_save_core(vm *v, state_core *core) {
+    memcpy(core->memory, v, IDLE_STATE_SIZE);
+    memcpy(core->gpu_memory, v->gpu_memory, GPU_MEMORY);
+    core->instret = v->instret;
+    core->rom_writes = v->rom_writes;
+    core->gpu_pointer = v->gpu_pointer;
+}
+
+void state_save(vm *v, save_state *s) {
+    state_save_core(v, &s->core);
+    if (!v->rom_copies && !s->rom_pages) return;
+    if (!s->rom_pages) {
+        s->rom_page_count = cart_rom_pages(v->cart);
+        s->rom_pages = calloc(s->rom_page_count, sizeof(uint8_t *));
+        ASSERT(s->rom_pages != NULL);
+    }
+    for (uint32_t p = 0; p < s->rom_page_count; p++) {
+        const uint8_t *copy = v->rom_copies ? v->rom_copies[p] : NULL;
+        if (copy) {
+            if (!s->rom_pages[p]) s->rom_pages[p] = malloc(PAGE_SIZE);
+            ASSERT(s->rom_pages[p] != NULL);
+            memcpy(s->rom_pages[p], copy, PAGE_SIZE);
+        } else if (s->rom_pages[p]) {
+            free(s->rom_pages[p]);
+            s->rom_pages[p] = NULL;
+        }
+    }
+}
+
+// Brings a ROM page back to `content`, only touching the translation
+// cache for the bytes that change. A copied page is kept even when it goes
+// back to the cart content.
+static void rom_restore_page(vm *v, uint32_t page, const uint8_t *content) {
+    const uint8_t *cart_page = v->cart->content + page * PAGE_SIZE;
+    uint8_t *copy = v->rom_copies ? v->rom_copies[page] : NULL;
+    if (!copy) {
+        if (content == cart_page || memcmp(content, cart_page, PAGE_SIZE) == 0) return;
+        if (!v->rom_copies) {
+            v->rom_copies = calloc(cart_rom_pages(v->cart), sizeof(uint8_t *));
+            ASSERT(v->rom_copies != NULL);
+        }
+        copy = v->rom_copies[page] = malloc(PAGE_SIZE);
+        ASSERT(copy != NULL);
+        memcpy(copy, cart_page, PAGE_SIZE);
+    }
+    for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+        if (copy[i] == content[i]) continue;
+        copy[i] = content[i];
+        if (page < ROM_BANK_PAGES) tc_invalidate(v, page * PAGE_SIZE + i);
+    }
+}
+
+void state_restore(vm *v, const save_state *s) {
+    memcpy(v, s->core.memory, IDLE_STATE_SIZE);
+    memcpy(v->gpu_memory, s->core.gpu_memory, GPU_MEMORY);
+    v->instret = s->core.instret;
+    v->rom_writes = s->core.rom_writes;
+    v->gpu_pointer = s->core.gpu_pointer;
+    v->background.valid = false;
+    if (v->rom_copies || s->rom_pages) {
+        for (uint32_t p = 0; p < cart_rom_pages(v->cart); p++) {
+            const uint8_t *content = s->rom_pages ? s->rom_pages[p] : NULL;
+            if (content || (v->rom_copies && v->rom_copies[p])) {
+                rom_restore_page(v, p, content ? content : v->cart->content + p * PAGE_SIZE);
+            }
+        }
+    }
+    // Bank pointers and copied pages are back, remap everything
+    map_memory(v);
+}
+
+void state_free(save_state *s) {
+    for (uint32_t p = 0; s->rom_pages && p < s->rom_page_count; p++) free(s->rom_pages[p]);
+    free(s->rom_pages);
+    s->rom_pages = NULL;
+}
+
+// Rewind: the newest state is kept whole, each older one as the XOR of
+// its core with the next one, run-length encoded, plus the previous
+// content of the ROM pages that changed. XOR being its own inverse the
+// states are rebuilt backwards from the newest one. Entries live in a
+// byte ring, "u32 size, payload, u32 size", the oldest being dropped when
+// full.
+typedef struct {
+    uint8_t *ring;
+    uint64_t capacity;
+    uint64_t head;   // Byte offsets, modulo capacity
+    uint64_t tail;
+    uint64_t used;
+    uint64_t states; // Held states, the newest one included
+    save_state newest;
+    save_state next; // Scratch for the state being pushed
+    uint8_t *entry;  // Scratch for one encoded entry
+    uint64_t entry_cap;
+} rewind_buffer;
+
+// The XOR of a and b as pairs of u16 run lengths, equal bytes then XOR'd
+// bytes, the latter stored. A literal run ends at 4 equal bytes, where a
+// new pair costs less. Needs up to 2 * n + 4 bytes.
+static size_t delta_encode(const uint8_t *a, const uint8_t *b, size_t n, uint8_t *out) {
+    size_t o = 0;
+    size_t i = 0;
+    while (i < n) {
+        size_t same = 0;
+        while (i + same + 8 <= n && same + 8 <= UINT16_MAX && memcmp(a + i + same, b + i + same, 8) == 0) same += 8;
+        while (i + same < n && same < UINT16_MAX && a[i + same] == b[i + same]) same++;
+        i += same;
+        size_t diff = 0;
+        while (i + diff < n && diff + 4 < UINT16_MAX) {
+            size_t k = 0;
+            while (k < 4 && i + diff + k < n && a[i + diff + k] == b[i + diff + k]) k++;
+            if (k == 4 || i + diff + k == n) break;
+            diff += k + 1;
+        }
+        uint16_t runs[2] = { same, diff };
+        memcpy(out + o, runs, sizeof(runs));
+        o += sizeof(runs);
+        for (size_t k = 0; k < diff; k++) out[o++] = a[i + k] ^ b[i + k];
+        i += diff;
+    }
+    return o;
+}
+
+// XORs an encoded delta into dst, returns the encoded size
+static size_t delta_apply(uint8_t *dst, size_t n, const uint8_t *in) {
+    size_t o = 0;
+    size_t i = 0;
+    while (i < n) {
+        uint16_t runs[2];
+        memcpy(runs, in + o, sizeof(runs));
+        o += sizeof(runs);
+        i += runs[0];
+        for (size_t k = 0; k < runs[1]; k++) dst[i + k] ^= in[o++];
+        i += runs[1];
+    }
+    return o;
+}
+
+static void ring_write(rewind_buffer *r, const void *data, uint64_t n) {
+    uint64_t start = r->head % r->capacity;
+    uint64_t first = n < r->capacity - start ? n : r->capacity - start;
+    memcpy(r->ring + start, data, first);
+    memcpy(r->ring, (const uint8_t *)data + first, n - first);
+    r->head += n;
+    r->used += n;
+}
+
+static void ring_read(const rewind_buffer *r, uint64_t offset, void *data, uint64_t n) {
+    uint64_t start = offset % r->capacity;
+    uint64_t first = n < r->capacity - start ? n : r->capacity - start;
+    memcpy(data, r->ring + start, first);
+    memcpy((uint8_t *)data + first, r->ring, n - first);
+}
+
+rewind_buffer *rewind_create(uint64_t capacity) {
+    rewind_buffer *r = calloc(1, sizeof(rewind_buffer));
+    ASSERT(r != NULL);
+    r->capacity = capacity;
+    r->ring = malloc(capacity);
+    ASSERT(r->ring != NULL);
+    return r;
+}
+
+// Makes `newest` the state of v, after storing how to go back from it
+void rewind_push(rewind_buffer *r, vm *v) {
+    if (r->states == 0) {
+        state_save(v, &r->newest);
+        r->states = 1;
+        return;
+    }
+    save_state *cur = &r->next;
+    state_save(v, cur);
+
+    uint64_t pages = r->newest.rom_pages || cur->rom_pages ? cart_rom_pages(v->cart) : 0;
+    uint64_t need = 2 * sizeof(state_core) + 16 + pages * (sizeof(uint32_t) + PAGE_SIZE);
+    if (need > r->entry_cap) {
+        r->entry = realloc(r->entry, need);
+        ASSERT(r->entry != NULL);
+        r->entry_cap = need;
+    }
+    uint64_t n = delta_encode((const uint8_t *)&r->newest.core, (const uint8_t *)&cur->core,
+                              sizeof(state_core), r->entry);
+    if (r->newest.core.rom_writes != cur->core.rom_writes) {
+        for (uint32_t p = 0; p < pages; p++) {
+            const uint8_t *cart_page = v->cart->content + p * PAGE_SIZE;
+            const uint8_t *old = r->newest.rom_pages && r->newest.rom_pages[p] ? r->newest.rom_pages[p] : cart_page;
+            const uint8_t *new = cur->rom_pages && cur->rom_pages[p] ? cur->rom_pages[p] : cart_page;
+            if (old == new || memcmp(old, new, PAGE_SIZE) == 0) continue;
+            memcpy(r->entry + n, &p, sizeof(p));
+            memcpy(r->entry + n + sizeof(p), old, PAGE_SIZE);
+            n += sizeof(p) + PAGE_SIZE;
+        }
+    }
+
+    uint32_t size = n;
+    if (n + 2 * sizeof(size) > r->capacity) {
+        // Cannot fit at all, forget the history instead
+        r->head = r->tail = r->used = 0;
+        r->states = 1;
+    } else {
+        while (r->used + n + 2 * sizeof(size) > r->capacity) {
+            uint32_t oldest;
+            ring_read(r, r->tail, &oldest, sizeof(oldest));
+            r->tail += oldest + 2 * sizeof(oldest);
+            r->used -= oldest + 2 * sizeof(oldest);
+            r->states--;
+        }
+        ring_write(r, &size, sizeof(size));
+        ring_write(r, r->entry, n);
+        ring_write(r, &size, sizeof(size));
+        r->states++;
+    }
+    save_state previous = r->newest;
+    r->newest = *cur;
+    r->next = previous;
+}
+
+// Restores v to the newest state and drops it, the one before becoming
+// the newest. Returns false once there is nothing left.
+bool rewind_pop(rewind_buffer *r, vm *v) {
+    if (r->states == 0) return false;
+    state_restore(v, &r->newest);
+    r->states--;
+    if (r->states == 0) return true;
+
+    uint32_t size;
+    ring_read(r, r->head - sizeof(size), &size, sizeof(size));
+    if (size > r->entry_cap) {
+        r->entry = realloc(r->entry, size);
+        ASSERT(r->entry != NULL);
+        r->entry_cap = size;
+    }
+    ring_read(r, r->head - sizeof(size) - size, r->entry, size);
+    r->head -= size + 2 * sizeof(size);
+    r->used -= size + 2 * sizeof(size);
+
+    save_state *s = &r->newest;
+    uint64_t n = delta_apply((uint8_t *)&s->core, sizeof(state_core), r->entry);
+    for (; n < size; n += sizeof(uint32_t) + PAGE_SIZE) {
+        uint32_t p;
+        memcpy(&p, r->entry + n, sizeof(p));
+        if (!s->rom_pages) {
+            s->rom_page_count = cart_rom_pages(v->cart);
+            s->rom_pages = calloc(s->rom_page_count, sizeof(uint8_t *));
+            ASSERT(s->rom_pages != NULL);
+        }
+        if (!s->rom_pages[p]) s->rom_pages[p] = malloc(PAGE_SIZE);
+        ASSERT(s->rom_pages[p] != NULL);
+        memcpy(s->rom_pages[p], r->entry + n + sizeof(p), PAGE_SIZE);
+    }
+    return true;
+}
+
+void rewind_free(rewind_buffer *r) {
+    state_free(&r->newest);
+    state_free(&r->next);
+    free(r->entry);
+    free(r->ring);
+    free(r);
+}
+
+// Guest instructions run looking for a GPU refresh before the run loops
+// get control back, so a cart stuck in a loop that never refreshes can
+// still be stopped. About 3000 frames of refresh.bin.
+#define REFRESH_BUDGET (1 << 24)
+
+// Steps the guest until it requests a GPU refresh, false when `budget`
+// instructions ran first. The guest is left where it was and resumes on
+// the next call.
+bool vm_run_until_refresh(vm *v, uint64_t budget) {
+    uint64_t end = v->instret + budget;
+    while (mem_read(v, 0x8000) != 1) {
+        if (v->instret >= end) return false;
+        vm_step(v);
+    }
+    return true;
+}
+
+// Runs until the next GPU refresh and draws the frame into gpu_memory.
+// False when the guest used up REFRESH_BUDGET first, gpu_memory is then
+// left as it was.
+bool vm_run_frame(vm *v) {
+    if (!vm_run_until_refresh(v, REFRESH_BUDGET)) return false;
+    mem_write(v, 0x8000, 0);
+    render_background(v);
+    return true;
+}
+
+// Frame pacing: frames are presented on a grid of 1 / target_fps seconds.
+// The host sleeps until shortly before the deadline and spins the rest,
+// the spin margin following the worst recent oversleep of the OS. A host
+// more than a frame late restarts the grid rather than rushing frames.
+#define PACER_MIN_SPIN 0.0002
+#define PACER_MAX_SPIN 0.004
+
+typedef struct {
+    double period;
+    double next;  // Deadline of the next frame
+    double spin;  // Time before the deadline spent spinning
+    double last;  // Last present, 0 before the first
+    double *intervals; // Between presents, for the jitter report
+    uint64_t count;
+    uint64_t cap;
+    uint64_t resets;
+} frame_pacer;
+
+void pacer_init(frame_pacer *p, uint8_t fps) {
+    *p = (frame_pacer){ .period = 1.0 / (fps ? fps : 60), .spin = 0.001 };
+    p->next = now_seconds() + p->period;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Returns once the next frame is due
+void pacer_wait(frame_pacer *p) {
+    double now = now_seconds();
+    if (now > p->next + p->period) {
+        p->next = now;
+        p->resets++;
+    }
+    double wake = p->next - p->spin;
+    if (wake > now) {
+        struct timespec ts = { (time_t)wake, (long)((wake - (time_t)wake) * 1e9) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        double over = now_seconds() - wake;
+        p->spin = over > p->spin ? over : p->spin * 0.99 + over * 0.01;
+        if (p->spin < PACER_MIN_SPIN) p->spin = PACER_MIN_SPIN;
+        if (p->spin > PACER_MAX_SPIN) p->spin = PACER_MAX_SPIN;
+    }
+    while (now_seconds() < p->next) cpu_relax();
+    p->next += p->period;
+}
+
+// Called once the frame is presented
+void pacer_presented(frame_pacer *p) {
+    double now = now_seconds();
+    if (p->last) {
+        if (p->count == p->cap) {
+            p->cap = p->cap ? p->cap * 2 : 4096;
+            p->intervals = realloc(p->intervals, p->cap * sizeof(double));
+            ASSERT(p->intervals != NULL);
+        }
+        p->intervals[p->count++] = now - p->last;
+    }
+    p->last = now;
+}
+
+static int interval_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void pacer_report(frame_pacer *p, FILE *out) {
+    if (!p->count) return;
+    double sum = 0;
+    double sq = 0;
+    uint64_t late = 0;
+    for (uint64_t i = 0; i < p->count; i++) {
+        double d = p->intervals[i] - p->period;
+        sum += p->intervals[i];
+        sq += d * d;
+        if (p->intervals[i] > p->period * 1.5) late++;
+    }
+    qsort(p->intervals, p->count, sizeof(double), interval_cmp);
+    fprintf(out, "pacing: %llu frames at %.0f FPS, interval %.3fms mean, jitter %.3fms rms, "
+                 "%.3fms min, %.3fms p99, %.3fms max, %llu late, %llu resets\n",
+            (unsigned long long)p->count, 1 / p->period, sum / p->count * 1e3, sqrt(sq / p->count) * 1e3,
+            p->intervals[0] * 1e3, p->intervals[p->count * 99 / 100] * 1e3, p->intervals[p->count - 1] * 1e3,
+            (unsigned long long)late, (unsigned long long)p->resets);
+}
+
+void pacer_free(frame_pacer *p) {
+    free(p->intervals);
+    p->intervals = NULL;
+}
+
+// Run-ahead: at each refresh the guest is saved, run `frames` frames
+// further with the input just read, and put back. The last of these
+// frames is the one shown, so the input shows up `frames` frames earlier.
+typedef struct {
+    uint32_t frames;
+    save_state state;
+    uint8_t gpu_memory[GPU_MEMORY]; // Frame shown
+    uint64_t count;
+    double time;
+    double max_time;
+} run_ahead;
+
+void run_ahead_frame(run_ahead *ra, vm *v, uint8_t input) {
+    double start = now_seconds();
+    state_save(v, &ra->state);
+    // Frames run ahead are thrown away, they stay out of the trace
+    tracer *trace = v->trace;
+    v->trace = NULL;
+    for (uint32_t i = 0; i < ra->frames; i++) {
+        mem_write(v, 0x8005, input);
+        if (!vm_run_frame(v)) break;
+    }
+    v->trace = trace;
+    memcpy(ra->gpu_memory, v->gpu_memory, GPU_MEMORY);
+    state_restore(v, &ra->state);
+
+    double elapsed = now_seconds() - start;
+    ra->count++;
+    ra->time += elapsed;
+    if (elapsed > ra->max_time) ra->max_time = elapsed;
+}
+
+void run_ahead_report(const run_ahead *ra, const cartdridge *cart) {
+    if (!ra->count) return;
+    uint8_t fps = cart->header.target_fps ? cart->header.target_fps : 60;
+    double average = ra->time / ra->count;
+    printf("run-ahead: %u frames, %.3fms per refresh on average, %.3fms at worst, %.1f%% of a %u FPS frame\n",
+           ra->frames, average * 1e3, ra->max_time * 1e3, 100 * average * fps, fps);
+}
+
+// Frames go from the emulation thread to the present thread through a
+// triple buffer. The writer fills `back` and swaps it with `shared`, the
+// reader swaps `front` with `shared` when it holds a fresh frame. Neither
+// side waits for the other and the frame being drawn is never written.
+#define FRAME_FRESH 4
+
+typedef struct {
+    uint8_t buffers[3][GPU_MEMORY];
+    _Alignas(64) _Atomic uint8_t shared; // Buffer index, | FRAME_FRESH until taken
+    uint8_t back;  // Written by the emulation thread
+    uint8_t front; // Drawn by the present thread
+} triple_buffer;
+
+static void frame_publish(triple_buffer *t) {
+    t->back = atomic_exchange_explicit(&t->shared, t->back | FRAME_FRESH, memory_order_acq_rel) & 3;
+}
+
+// Makes the latest frame the front one, false when there is no new frame
+static bool frame_take(triple_buffer *t) {
+    if (!(atomic_load_explicit(&t->shared, memory_order_relaxed) & FRAME_FRESH)) return false;
+    t->front = atomic_exchange_explicit(&t->shared, t->front, memory_order_acq_rel) & 3;
+    return true;
+}
+
+// State shared by vm_run and its emulation thread. Input is sampled by the
+// present thread, which owns the window.
+typedef struct {
+    vm *v;
+    frame_pacer *pacer;
+    profiler *prof;
+    tracer *trace;
+    movie *mv;
+    rewind_buffer *rw;
+    run_ahead *ra;
+    triple_buffer frames;
+    uint8_t shown[GPU_MEMORY]; // Last frame handed over
+    _Atomic uint8_t input;
+    _Atomic bool rewind_key;
+    _Atomic bool stop;
+} emulator;
+
+// Instructions between two looks at `stop` while waiting for a refresh
+#define EMULATION_SLICE (1 << 20)
+
+static void *emulation_main(void *arg) {
+    emulator *e = arg;
+    vm *v = e->v;
+    profiler *prof = e->prof;
+    idle_tracker idle = {};
+    bool instrumented = prof != NULL;
+    bool rewinding = false;
+    if (prof) prof->mark = now_seconds();
+    while (!atomic_load_explicit(&e->stop, memory_order_relaxed)) {
+        // Past the oldest state the pop fails and the frame is held
+        // until backspace is released
+        if (rewinding) {
+            rewind_pop(e->rw, v);
+            idle = (idle_tracker){};
+        }
+        // While idle the guest would only run back to this same refresh,
+        // so it is not stepped and the host only waits for the next frame
+        if (!rewinding && !idle.idle) {
+            // In slices, so a guest that never refreshes can still be stopped
+            bool refreshed = false;
+            while (!refreshed && !atomic_load_explicit(&e->stop, memory_order_relaxed)) {
+                if (instrumented) {
+                    uint64_t end = v->instret + EMULATION_SLICE;
+                    while (!(refreshed = mem_read(v, 0x8000) == 1) && v->instret < end) {
+                        instrumented_step(v, prof, e->trace);
+                    }
+                } else {
+                    refreshed = vm_run_until_refresh(v, EMULATION_SLICE);
+                }
+            }
+            if (!refreshed) break;
+            mem_write(v, 0x8000, 0);
+        }
+        if (prof) profile_lap(prof, &prof->interp_time);
+        uint8_t input = atomic_load_explicit(&e->input, memory_order_relaxed);
+        bool rewind_key = e->rw && atomic_load_explicit(&e->rewind_key, memory_order_relaxed);
+        if (!rewinding && !rewind_key && e->mv) input = movie_input(e->mv, input);
+        bool same_frame = idle.idle && input == v->system_io[0x05];
+
+        // While idle with the same input the frame shown is still right.
+        // Frames equal to the one shown are not handed over either, which
+        // spares the present thread the texture upload and the present.
+        bool fresh = false;
+        if (!same_frame) {
+            bool changed = render_background(v);
+            bool ahead = e->ra && !rewinding;
+            if (ahead) run_ahead_frame(e->ra, v, input);
+            const uint8_t *frame = ahead ? e->ra->gpu_memory : v->gpu_memory;
+            fresh = (changed || ahead) && memcmp(frame, e->shown, GPU_MEMORY) != 0;
+            if (fresh) {
+                memcpy(e->shown, frame, GPU_MEMORY);
+                memcpy(e->frames.buffers[e->frames.back], frame, GPU_MEMORY);
+            }
+        }
+        if (prof) profile_lap(prof, &prof->render_time);
+        // Frames are handed over on the grid, the present thread shows
+        // them as soon as it sees them
+        pacer_wait(e->pacer);
+        if (fresh) frame_publish(&e->frames);
+        pacer_presented(e->pacer);
+        if (prof) profile_lap(prof, &prof->present_time);
+        if (rewinding || rewind_key) {
+            rewinding = rewind_key;
+            continue;
+        }
+        if (same_frame) continue;
+        mem_write(v, 0x8005, input);
+        idle_check(&idle, v);
+        if (e->rw) rewind_push(e->rw, v);
+    }
+    return NULL;
+}
+
+// Runs the guest on an emulation thread paced by `pacer`, while this
+// thread presents its frames and samples the input, so a slow present
+// never holds the guest back. prof and trace are NULL unless profiling or
+// tracing, mv unless recording or replaying a movie, rw unless rewind is
+// enabled and ra unless running ahead. Holding backspace rewinds one frame
+// per guest frame, then holds the oldest one.
+void vm_run(vm *v, frame_pacer *pacer, profiler *prof, tracer *trace, movie *mv, rewind_buffer *rw, run_ahead *ra) {
+    emulator *e = calloc(1, sizeof(emulator));
+    ASSERT(e != NULL);
+    *e = (emulator){ v, pacer, prof, trace, mv, rw, ra, .frames = { .shared = 1, .back = 0, .front = 2 } };
+    // Not a palette index, the first frame always differs
+    memset(e->shown, 0xFF, GPU_MEMORY);
+    pthread_t thread;
+    ASSERT(pthread_create(&thread, NULL, emulation_main, e) == 0);
+    static screen scr;
+    screen_init(&scr);
+
+    double drawn = 0;
+    // When the emulation thread should hand over the next frame, on the
+    // pacer grid as seen from the last fresh frame
+    double due = now_seconds();
+    while (!WindowShouldClose()) {
+        atomic_store_explicit(&e->input, read_input(), memory_order_relaxed);
+        atomic_store_explicit(&e->rewind_key, IsKeyDown(KEY_BACKSPACE), memory_order_relaxed);
+        bool fresh = frame_take(&e->frames);
+        // raylib reports resizes but not exposes, so the frame shown is
+        // also drawn again every SCREEN_REDRAW_PERIOD while nothing changes
+        bool redraw = IsWindowResized() || now_seconds() - drawn > SCREEN_REDRAW_PERIOD;
+        if (!fresh && !redraw) {
+            // Nothing new to show: sleep until the next frame is due or
+            // the next redraw, polling the input about once a frame
+            double now = now_seconds();
+            if (due <= now) due += (floor((now - due) / pacer->period) + 1) * pacer->period;
+            double wake = fmin(due, drawn + SCREEN_REDRAW_PERIOD);
+            struct timespec ts = { (time_t)wake, (long)((wake - (time_t)wake) * 1e9) };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            PollInputEvents();
+            continue;
+        }
+        if (fresh) {
+            screen_upload(&scr, e->frames.buffers[e->frames.front]);
+            due = now_seconds() + pacer->period;
+        }
+        BeginDrawing();
+            ClearBackground(BLACK);
+            screen_draw(&scr);
+        EndDrawing();
+        drawn = now_seconds();
+    }
+    screen_free(&scr);
+
+    atomic_store(&e->stop, true);
+    pthread_join(thread, NULL);
+    free(e);
+}
+
+// FNV-1a over everything the guest can observe
+uint64_t state_hash(vm *v) {
+    uint64_t hash = 0xCBF29CE484222325;
+#define HASH_BYTES(p, n) \
+    for (size_t i = 0; i < (n); i++) { hash ^= ((const uint8_t *)(p))[i]; hash *= 0x100000001B3; }
+    HASH_BYTES(v->system_io, sizeof(v->system_io));
+    HASH_BYTES(v->ram, sizeof(v->ram));
+    HASH_BYTES(v->gpu_tiles, sizeof(v->gpu_tiles));
+    HASH_BYTES(v->stack, sizeof(v->stack));
+    HASH_BYTES(v->regs, sizeof(v->regs));
+    HASH_BYTES(&v->sp, sizeof(v->sp));
+    HASH_BYTES(&v->pc, sizeof(v->pc));
+    HASH_BYTES(&v->flags, sizeof(v->flags));
+    HASH_BYTES(v->gpu_memory, sizeof(v->gpu_memory));
+    for (uint32_t addr = 0; addr <= 0x3FFF; addr++) {
+        uint8_t b = mem_read(v, addr);
+        HASH_BYTES(&b, 1);
+    }
+#undef HASH_BYTES
+    return hash;
+}
+
+// Runs without a window until max_frames GPU refreshes or max_instructions
+// instructions, 0 meaning no limit. The input only changes when replaying
+// a movie. With skip_idle, frames are skipped once the guest idles until
+// the input changes. Refreshes are paced when pacer is not NULL.
+void vm_run_headless(vm *v, uint64_t max_frames, uint64_t max_instructions, bool skip_idle,
+                     frame_pacer *pacer, profiler *prof, tracer *trace, movie *mv, rewind_buffer *rw, run_ahead *ra) {
+    idle_tracker idle = {};
+    bool instrumented = prof != NULL;
+    uint64_t frames = 0;
+    uint64_t skipped = 0;
+    double push_time = 0;
+    double start = now_seconds();
+    if (prof) prof->mark = start;
+    while ((!max_frames || frames < max_frames)
+           && (!max_instructions || v->instret < max_instructions)) {
+        if (instrumented) {
+            instrumented_step(v, prof, trace);
+        } else if (max_instructions && max_instructions - v->instret < TC_MAX_BLOCK) {
+            // Single step near the end so the count is exact
+            instrumented_step(v, NULL, trace);
+        } else {
+            vm_step(v);
+        }
+        if (mem_read(v, 0x8000) == 1) {
+            if (prof) profile_lap(prof, &prof->interp_time);
+            mem_write(v, 0x8000, 0);
+            render_background(v);
+            if (prof) profile_lap(prof, &prof->render_time);
+            if (pacer) {
+                pacer_wait(pacer);
+                pacer_presented(pacer);
+            }
+            frames++;
+            uint8_t input = mv ? movie_input(mv, v->system_io[0x05]) : v->system_io[0x05];
+            if (ra) run_ahead_frame(ra, v, input);
+            if (mv) mem_write(v, 0x8005, input);
+            if (rw) {
+                double push_start = now_seconds();
+                rewind_push(rw, v);
+                push_time += now_seconds() - push_start;
+            }
+            if (skip_idle && max_frames && idle_check(&idle, v)) {
+                while (frames < max_frames && (!mv || movie_next_is(mv, v->system_io[0x05]))) {
+                    if (mv) movie_input(mv, v->system_io[0x05]);
+                    frames++;
+                    skipped++;
+                }
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+    if (prof) profile_lap(prof, &prof->interp_time);
+
+    dump(v);
+    printf("STATE=%016llx\n", (unsigned long long)state_hash(v));
+    printf("%llu frames, %llu instructions in %.3fs: %.1f MIPS, %.1f FPS\n",
+           (unsigned long long)frames, (unsigned long long)v->instret, elapsed,
+           v->instret / elapsed / 1e6, frames / elapsed);
+    if (skip_idle) printf("%llu idle frames skipped\n", (unsigned long long)skipped);
+    if (v->halts) printf("%llu HALT instructions\n", (unsigned long long)v->halts);
+    if (rw && rw->states > 1) {
+        printf("rewind: %llu frames in %.2f MB, %.0f bytes per frame, %.2fus per push\n",
+               (unsigned long long)rw->states, rw->used / 1e6, (double)rw->used / (rw->states - 1),
+               push_time * 1e6 / (frames - skipped));
+    }
+}
+
+// Multi-instance runner: a pool of vm sharing one cart, stepped one frame
+// at a time by worker threads. Each worker owns a queue of instances per
+// frame, taken from the front by its owner and stolen from the back by
+// idle workers. A queue is a [next, end) range packed in one atomic word.
+typedef struct {
+    vm v; // wait_on_halt stays off: workers never touch stdin, HALT is counted
+    uint32_t input_state; // xorshift32 state of the instance input stream
+    bool aborted;
+} instance;
+
+typedef struct {
+    _Atomic uint64_t range;
+} work_queue;
+
+typedef struct lockstep_group lockstep_group;
+
+typedef struct {
+    instance *instances;
+    uint32_t instance_count;
+    lockstep_group *groups; // Set when running in lockstep
+    uint32_t item_count;    // Instances or groups scheduled per frame
+    work_queue *queues;
+    uint32_t thread_count;
+    uint64_t frames;
+    pthread_barrier_t barrier;
+} runner;
+
+typedef struct {
+    runner *r;
+    uint32_t id;
+} worker;
+
+static uint64_t pack_range(uint32_t next, uint32_t end) { return (uint64_t)end << 32 | next; }
+
+static int64_t queue_take(work_queue *q) {
+    uint64_t range = atomic_load(&q->range);
+    for (;;) {
+        uint32_t next = range, end = range >> 32;
+        if (next >= end) return -1;
+        if (atomic_compare_exchange_weak(&q->range, &range, pack_range(next + 1, end))) return next;
+    }
+}
+
+static int64_t queue_steal(work_queue *q) {
+    uint64_t range = atomic_load(&q->range);
+    for (;;) {
+        uint32_t next = range, end = range >> 32;
+        if (next >= end) return -1;
+        if (atomic_compare_exchange_weak(&q->range, &range, pack_range(next, end - 1))) return end - 1;
+    }
+}
+
+// Bots press random buttons, holding them for 8 frames
+static uint8_t next_input(instance *in, uint64_t frame) {
+    if (frame % 8 == 0) {
+        in->input_state ^= in->input_state << 13;
+        in->input_state ^= in->input_state >> 17;
+        in->input_state ^= in->input_state << 5;
+    }
+    return in->input_state;
+}
+
+static void instance_frame(instance *in, uint64_t frame) {
+    if (in->aborted) return;
+    jmp_buf on_abort;
+    in->v.on_abort = &on_abort;
+    if (setjmp(on_abort)) {
+        in->v.on_abort = NULL;
+        in->aborted = true;
+        return;
+    }
+    mem_write(&in->v, 0x8005, next_input(in, frame));
+    vm_run_frame(&in->v);
+    in->v.on_abort = NULL;
+}
+
+// Lockstep engine: steps groups of LOCKSTEP_LANES instances of one cart
+// with their registers, flags, PC and SP stored as structure of arrays.
+// Each step runs the instruction at the lowest PC of the group for every
+// lane sitting on it, using vector lanes for register only instructions.
+// Other instructions, lanes running a private copy of a ROM page and
+// lanes at other PCs go through the scalar interpreter one lane at a time.
+// The vm structs hold the state between frames. A lane aborting in a
+// vector step has none of that instruction's effects yet, it is run again
+// by the scalar interpreter so it aborts with the same state as in the
+// multi-instance runner.
+#define LOCKSTEP_LANES 32
+#define LOCKSTEP_TARGETS __attribute__((target_clones("avx2", "default")))
+
+// Aligned for AVX2 even in the default clone, where GCC would only give
+// them 16 bytes while the avx2 clone loads them with aligned moves
+#define LANE_VECTOR(n) __attribute__((vector_size(n), aligned(32)))
+
+typedef uint8_t lane_u8 LANE_VECTOR(LOCKSTEP_LANES);
+typedef int8_t lane_i8 LANE_VECTOR(LOCKSTEP_LANES);
+typedef uint16_t lane_u16 LANE_VECTOR(LOCKSTEP_LANES * 2);
+typedef int16_t lane_i16 LANE_VECTOR(LOCKSTEP_LANES * 2);
+typedef uint64_t lane_u64 LANE_VECTOR(LOCKSTEP_LANES * 8);
+typedef int64_t lane_i64 LANE_VECTOR(LOCKSTEP_LANES * 8);
+
+struct lockstep_group {
+    lane_u8 regs[REG_COUNT];
+    lane_u8 flags;
+    lane_u16 pc;
+    lane_u16 sp;
+    lane_u64 instret;
+    lane_i8 active; // -1 for lanes still running the current frame
+    lane_i8 shared; // -1 for lanes whose ROM is the cart's, eligible to vector steps
+    instance *lanes[LOCKSTEP_LANES];
+    uint32_t lane_count;
+    uint32_t current; // Lane being stepped, to know which one aborted
+    bool in_vector;   // Set while lockstep_vector runs
+    uint64_t steps;
+    uint64_t frame_end[LOCKSTEP_LANES]; // Instruction count a lane stops at
+};
+
+#define SELECT(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+static void lockstep_load(lockstep_group *g, uint32_t k) {
+    vm *v = &g->lanes[k]->v;
+    for (uint8_t r = 0; r < REG_COUNT; r++) g->regs[r][k] = v->regs[r];
+    g->flags[k] = v->flags;
+    g->pc[k] = v->pc;
+    g->sp[k] = v->sp;
+}
+
+static void lockstep_store(lockstep_group *g, uint32_t k) {
+    vm *v = &g->lanes[k]->v;
+    for (uint8_t r = 0; r < REG_COUNT; r++) v->regs[r] = g->regs[r][k];
+    v->flags = g->flags[k];
+    v->pc = g->pc[k];
+    v->sp = g->sp[k];
+    v->instret += g->instret[k];
+    g->instret[k] = 0;
+}
+
+static void lockstep_scalar(lockstep_group *g, uint32_t k) {
+    vm *v = &g->lanes[k]->v;
+    g->current = k;
+    lockstep_store(g, k);
+    vm_exec_opcode(v);
+    advance_pc(v);
+    v->instret++;
+    lockstep_load(g, k);
+    if (v->system_io[0x00] == 1) g->active[k] = 0;
+}
+
+#define FOR_LANES(m, k) \
+    for (uint32_t k = 0; k < g->lane_count; k++) if (m[k] && (g->current = k, true))
+
+static bool lanes_any(const lane_i8 *m) {
+    uint64_t words[LOCKSTEP_LANES / 8];
+    memcpy(words, m, sizeof(words));
+    uint64_t any = 0;
+    for (uint32_t i = 0; i < LOCKSTEP_LANES / 8; i++) any |= words[i];
+    return any != 0;
+}
+
+// A write may request a refresh, which ends the lane's frame, or copy a
+// ROM page, after which the lane can't share decoded code anymore
+static void lockstep_after_write(lockstep_group *g, uint32_t k) {
+    vm *v = &g->lanes[k]->v;
+    if (v->system_io[0x00] == 1) g->active[k] = 0;
+    if (v->rom_copies) g->shared[k] = 0;
+}
+
+// Memory instructions finish a lane, moving its pc on, before starting the
+// next one. When a lane aborts, the lanes before it are done with the
+// instruction and the lanes after it have not started it.
+#define COMMIT_LANE(k, to) do { g->pc[k] = (to); g->instret[k]++; m[k] = 0; } while (0)
+
+// Runs the instruction at pc for the lanes in m, false when it has no
+// lockstep translation. Register work is done on whole vectors, memory
+// accesses loop over the lanes since each lane has its own memory.
+// Inlined in each lockstep_step clone.
+__attribute__((always_inline))
+static inline bool lockstep_vector(lockstep_group *g, const cartdridge *cart, uint16_t pc, const lane_i8 *lanes) {
+    lane_i8 m = *lanes;
+    if (pc > TC_ROM_END) return false;
+    uint8_t value = cart->content[pc];
+    uint8_t opcode = value & OPCODE_MASK;
+    uint8_t mode = value >> 5;
+    uint8_t length = inst_table[value].length;
+    if (pc + length - 1 > TC_ROM_END || inst_table[value].exec == exec_halt
+        || inst_table[value].exec == exec_unknown) return false;
+    uint16_t raw = 0;
+    if (length == 2) raw = cart->content[pc + 1];
+    if (length == 3) raw = cart->content[pc + 1] << 8 | cart->content[pc + 2];
+
+    // Operand of the instruction, truncated to 8 bits like every user
+    // except SAM, which only takes the modes below as addresses
+    lane_u8 operand = {};
+    bool resolves = opcode != NOOP && opcode != NOT && opcode != JMP && opcode != POP;
+    if (resolves) {
+        switch (mode) {
+            case 0: case 3: operand += (uint8_t)raw; break;
+            case 1: case 4:
+                if (opcode == SAM) return false;
+                FOR_LANES(m, k) operand[k] = mem_read(&g->lanes[k]->v, raw);
+                break;
+            case 2:
+                if (raw >= REG_COUNT) return false;
+                operand = g->regs[raw];
+                break;
+            case 5:
+                if ((raw >> 8) >= REG_COUNT || (raw & 0xFF) >= REG_COUNT) return false;
+                if (opcode == SAM) break;
+                operand = g->regs[raw & 0xFF];
+                break;
+            case 6: operand = (g->flags & FLAG(C)) >> 1; break;
+            case 7: operand += (uint8_t)pc; break;
+        }
+    }
+
+    lane_u8 mask = (lane_u8)m;
+    lane_u8 r0 = g->regs[0];
+    lane_u8 flags = g->flags;
+    lane_u16 next = (lane_u16){} + (uint16_t)(pc + length);
+    lane_u8 result;
+    switch (opcode) {
+        case NOOP: break;
+        case LDA:
+            g->regs[0] = SELECT(mask, operand, r0);
+            break;
+        case SAR:
+            if (mode != 0 || raw >= REG_COUNT) return false;
+            g->regs[raw] = SELECT(mask, r0, g->regs[raw]);
+            break;
+        case SAM:
+            FOR_LANES(m, k) {
+                uint16_t addr = raw;
+                if (mode == 2 || mode == 6 || mode == 7) addr = operand[k];
+                if (mode == 7) addr = pc;
+                if (mode == 5) addr = g->regs[raw >> 8][k] << 8 | g->regs[raw & 0xFF][k];
+                mem_write(&g->lanes[k]->v, addr, r0[k]);
+                COMMIT_LANE(k, next[k]);
+                lockstep_after_write(g, k);
+            }
+            break;
+        case PSH:
+            FOR_LANES(m, k) {
+                mem_write(&g->lanes[k]->v, g->sp[k], operand[k]);
+                g->sp[k]--;
+                COMMIT_LANE(k, next[k]);
+                lockstep_after_write(g, k);
+            }
+            break;
+        case POP:
+            if (mode == 7) {
+                FOR_LANES(m, k) {
+                    uint8_t to = mem_read(&g->lanes[k]->v, (uint16_t)(g->sp[k] + 1));
+                    g->sp[k]++;
+                    COMMIT_LANE(k, to + 1);
+                }
+                break;
+            }
+            if (mode != 0 || raw >= REG_COUNT) return false;
+            FOR_LANES(m, k) {
+                uint8_t popped = mem_read(&g->lanes[k]->v, (uint16_t)(g->sp[k] + 1));
+                g->sp[k]++;
+                g->regs[raw][k] = popped;
+                COMMIT_LANE(k, next[k]);
+            }
+            break;
+        case CMP:
+            result = (flags & (uint8_t)~FLAG(Z)) | ((lane_u8)(r0 == operand) & 1);
+            g->flags = SELECT(mask, result, flags);
+            break;
+        case ADD:
+        case AND:
+        case OR:
+        case NOT:
+        case SHR:
+        case SHL:
+            if (opcode == ADD) result = r0 + operand;
+            else if (opcode == AND) result = r0 & operand;
+            else if (opcode == OR) result = r0 | operand;
+            else if (opcode == NOT) result = ~r0;
+            else if (mode != 0 || raw >= 8) return false;
+            else if (opcode == SHR) result = r0 >> raw;
+            else result = r0 << raw;
+            // Same flag updates as SET_ZN, ADD also clears C
+            lane_u8 zn = ((lane_u8)(result == 0) & 2) | ((lane_u8)((lane_i8)result < 0) & 0x10);
+            lane_u8 keep = (lane_u8){} + (uint8_t)(opcode == ADD ? 0xF8 : 0xFA);
+            g->regs[0] = SELECT(mask, result, r0);
+            g->flags = SELECT(mask, (flags & keep) | zn, flags);
+            break;
+        case JMP: {
+            if (mode > 2) return false;
+            lane_u16 target = (lane_u16){} + raw;
+            lane_i16 taken = (lane_i16){} - 1;
+            lane_i16 z = __builtin_convertvector((lane_i8)((flags & FLAG(Z)) != 0), lane_i16);
+            if (mode == 1) taken = z;
+            if (mode == 2) taken = ~z;
+            next = SELECT((lane_u16)taken, target, next);
+            break;
+        }
+        default: return false;
+    }
+    g->pc = SELECT((lane_u16)__builtin_convertvector(m, lane_i16), next, g->pc);
+    g->instret -= (lane_u64)__builtin_convertvector(m, lane_i64);
+    return true;
+}
+
+// One step of the group, false once every lane reached its GPU refresh
+LOCKSTEP_TARGETS
+static bool lockstep_step(lockstep_group *g, const cartdridge *cart) {
+    if (!lanes_any(&g->active)) return false;
+    lane_u16 pcs = SELECT((lane_u16)__builtin_convertvector(g->active, lane_i16),
+                          g->pc, (lane_u16){} + 0xFFFF);
+    uint16_t leader = 0xFFFF;
+    for (uint32_t k = 0; k < LOCKSTEP_LANES; k++) leader = pcs[k] < leader ? pcs[k] : leader;
+
+    lane_i8 at_leader = __builtin_convertvector(g->pc == leader, lane_i8) & g->active;
+    lane_i8 vector = at_leader & g->shared;
+    g->in_vector = true;
+    if (!lanes_any(&vector) || !lockstep_vector(g, cart, leader, &vector)) vector = (lane_i8){};
+    g->in_vector = false;
+    lane_i8 scalar = at_leader & ~vector;
+    if (lanes_any(&scalar)) {
+        for (uint32_t k = 0; k < g->lane_count; k++) {
+            if (scalar[k]) lockstep_scalar(g, k);
+        }
+    }
+    return true;
+}
+
+static void lockstep_frame(lockstep_group *g, uint64_t frame) {
+    jmp_buf on_abort;
+    for (uint32_t k = 0; k < g->lane_count; k++) {
+        instance *in = g->lanes[k];
+        in->v.on_abort = &on_abort;
+        if (!in->aborted) mem_write(&in->v, 0x8005, next_input(in, frame));
+        lockstep_load(g, k);
+        g->frame_end[k] = in->v.instret + REFRESH_BUDGET;
+        g->active[k] = in->aborted ? 0 : -1;
+        g->shared[k] = in->v.rom_copies ? 0 : -1;
+    }
+    g->steps = 0;
+    if (setjmp(on_abort)) {
+        uint32_t k = g->current;
+        if (g->in_vector) {
+            g->in_vector = false;
+            g->shared[k] = 0;
+        } else {
+            // Keep what the interpreter left in the vm
+            lockstep_load(g, k);
+            g->lanes[k]->aborted = true;
+            g->active[k] = 0;
+        }
+    }
+    while (lockstep_step(g, g->lanes[0]->v.cart)) {
+        // Lanes that never refresh stop after about REFRESH_BUDGET
+        // instructions, like in vm_run_frame
+        if (++g->steps % 4096 != 0) continue;
+        for (uint32_t k = 0; k < g->lane_count; k++) {
+            if (g->lanes[k]->v.instret + g->instret[k] >= g->frame_end[k]) g->active[k] = 0;
+        }
+    }
+
+    for (uint32_t k = 0; k < g->lane_count; k++) {
+        instance *in = g->lanes[k];
+        in->v.on_abort = NULL;
+        lockstep_store(g, k);
+        if (in->aborted || in->v.system_io[0x00] != 1) continue;
+        mem_write(&in->v, 0x8000, 0);
+        render_background(&in->v);
+    }
+}
+
+static void run_item(runner *r, uint32_t i, uint64_t frame) {
+    if (r->groups) lockstep_frame(&r->groups[i], frame);
+    else instance_frame(&r->instances[i], frame);
+}
+
+static void *worker_main(void *arg) {
+    worker *w = arg;
+    runner *r = w->r;
+    for (uint64_t frame = 0; frame < r->frames; frame++) {
+        // Each worker takes an even share of the instances, or lockstep
+        // groups, as its own queue
+        uint32_t per_thread = (r->item_count + r->thread_count - 1) / r->thread_count;
+        uint32_t first = w->id * per_thread;
+        uint32_t last = first + per_thread;
+        if (first > r->item_count) first = r->item_count;
+        if (last > r->item_count) last = r->item_count;
+        atomic_store(&r->queues[w->id].range, pack_range(first, last));
+        pthread_barrier_wait(&r->barrier);
+
+        int64_t i;
+        while ((i = queue_take(&r->queues[w->id])) >= 0) run_item(r, i, frame);
+        for (uint32_t k = 1; k < r->thread_count; k++) {
+            work_queue *victim = &r->queues[(w->id + k) % r->thread_count];
+            while ((i = queue_steal(victim)) >= 0) run_item(r, i, frame);
+        }
+        pthread_barrier_wait(&r->barrier);
+    }
+    return NULL;
+}
+
+void run_instances(cartdridge *cart, uint32_t instance_count, uint32_t thread_count,
+                   uint64_t frames, bool jit, bool lockstep) {
+    runner r = {
+        .instance_count = instance_count,
+        .item_count = instance_count,
+        .thread_count = thread_count,
+        .frames = frames,
+    };
+    r.instances = calloc(instance_count, sizeof(instance));
+    r.queues = calloc(thread_count, sizeof(work_queue));
+    worker *workers = calloc(thread_count, sizeof(worker));
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    ASSERT(r.instances && r.queues && workers && threads);
+    for (uint32_t i = 0; i < instance_count; i++) {
+        r.instances[i].v.cart = cart;
+        r.instances[i].v.tc.jit_enabled = jit;
+        r.instances[i].input_state = 0x9E3779B9u * (i + 1);
+        vm_init(&r.instances[i].v);
+    }
+    if (lockstep) {
+        r.item_count = (instance_count + LOCKSTEP_LANES - 1) / LOCKSTEP_LANES;
+        size_t size = r.item_count * sizeof(lockstep_group);
+        r.groups = aligned_alloc(_Alignof(lockstep_group), (size + 63) & ~(size_t)63);
+        ASSERT(r.groups != NULL);
+        memset(r.groups, 0, size);
+        for (uint32_t i = 0; i < instance_count; i++) {
+            lockstep_group *g = &r.groups[i / LOCKSTEP_LANES];
+            g->lanes[g->lane_count++] = &r.instances[i];
+        }
+    }
+    pthread_barrier_init(&r.barrier, NULL, thread_count);
+
+    double start = now_seconds();
+    for (uint32_t t = 0; t < thread_count; t++) {
+        workers[t] = (worker){ &r, t };
+        ASSERT(pthread_create(&threads[t], NULL, worker_main, &workers[t]) == 0);
+    }
+    for (uint32_t t = 0; t < thread_count; t++) pthread_join(threads[t], NULL);
+    double elapsed = now_seconds() - start;
+
+    uint64_t instret = 0;
+    uint32_t aborted = 0;
+    uint32_t halted = 0;
+    uint64_t combined = 0;
+    for (uint32_t i = 0; i < instance_count; i++) {
+        instret += r.instances[i].v.instret;
+        aborted += r.instances[i].aborted;
+        halted += r.instances[i].v.halts != 0;
+        combined ^= state_hash(&r.instances[i].v) * (2 * i + 1);
+        vm_free(&r.instances[i].v);
+    }
+    printf("STATE=%016llx\n", (unsigned long long)combined);
+    printf("%u instances x %llu frames on %u threads in %.3fs: %.1f FPS, %.1f MIPS, %u aborted, %u halted\n",
+           instance_count, (unsigned long long)frames, thread_count, elapsed,
+           instance_count * frames / elapsed, instret / elapsed / 1e6, aborted, halted);
+
+    pthread_barrier_destroy(&r.barrier);
+    free(threads);
+    free(workers);
+    free(r.queues);
+    free(r.groups);
+    free(r.instances);
+}
+
+// bench.c includes this file and brings its own main
+#ifndef BENCH
+int main(int argc, char **argv) {
     vm v = {};
     cartdridge c = {};
     v.cart = &c;
+    const char *cart_path = "refresh.bin";
+    bool headless = false;
+    bool skip_idle = false;
+    const char *profile_path = NULL;
+    const char *trace_path = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    uint64_t rewind_mb = 0;
+    uint32_t run_ahead_frames = 0;
+    bool paced = false;
+    uint64_t max_frames = 0;
+    uint64_t max_instructions = 0;
+    uint32_t instances = 0;
+    bool lockstep = false;
+    uint32_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) v.tc.jit_enabled = true;
+        else if (strcmp(argv[i], "--headless") == 0) headless = true;
+        else if (strcmp(argv[i], "--skip-idle") == 0) skip_idle = true;
+        else if (strcmp(argv[i], "--paced") == 0) paced = true;
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) profile_path = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) trace_path = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay_path = argv[++i];
+        else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) rewind_mb = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) run_ahead_frames = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) max_frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc) max_instructions = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) instances = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--lockstep") == 0) lockstep = true;
+        else if (argv[i][0] != '-') cart_path = argv[i];
+        else {
+            fprintf(stderr, "Usage: %s [--jit] [--profile FILE] [--trace FILE] [--record FILE | --replay FILE] [--rewind MB] [--run-ahead N]\n"
+                            "          [--headless [--frames N] [--instructions N] [--skip-idle] [--paced]]\n"
+                            "          [--instances N [--threads N] [--frames N] [--lockstep]] [cart]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    cart_load(&c, cart_path);
+    if (instances) {
+        if (threads == 0) threads = 1;
+        run_instances(&c, instances, threads, max_frames ? max_frames : 600, v.tc.jit_enabled, lockstep);
+        return 0;
+    }
     vm_init(&v);
-    cart_load(&c, "refresh.bin");
-    vm_run(&v);
+    profiler *prof = NULL;
+    if (profile_path) {
+        prof = calloc(1, sizeof(profiler));
+        ASSERT(prof != NULL);
+    }
+    tracer *trace = NULL;
+    if (trace_path && !(trace = trace_open(trace_path))) return 1;
+    v.trace = trace;
+    movie *mv = NULL;
+    if (record_path && !(mv = movie_record(record_path, &c))) return 1;
+    if (replay_path && !(mv = movie_replay(replay_path, &c))) return 1;
+    rewind_buffer *rw = NULL;
+    if (rewind_mb) {
+        // A movie only holds inputs, it cannot follow the guest back
+        if (mv && !headless) {
+            fprintf(stderr, "--rewind cannot be used with movies in a window\n");
+            return 1;
+        }
+        rw = rewind_create(rewind_mb << 20);
+    }
+    run_ahead *ra = NULL;
+    if (run_ahead_frames) {
+        ra = calloc(1, sizeof(run_ahead));
+        ASSERT(ra != NULL);
+        ra->frames = run_ahead_frames;
+    }
+    frame_pacer pacer = {};
+    if (paced) pacer_init(&pacer, c.header.target_fps);
+    if (headless) {
+        // A replay runs the whole movie by default
+        if (!max_frames && !max_instructions) max_frames = replay_path && mv->frames ? mv->frames : 600;
+        vm_run_headless(&v, max_frames, max_instructions, skip_idle, paced ? &pacer : NULL, prof, trace, mv, rw, ra);
+    } else {
+        // Paced to the cart, raylib's own frame limiter stays off
+        InitWindow(128 * SCREEN_SCALE, 64 * SCREEN_SCALE, "8bit-console");
+        pacer_init(&pacer, c.header.target_fps);
+        v.wait_on_halt = true;
+        vm_run(&v, &pacer, prof, trace, mv, rw, ra);
+        paced = true;
+    }
+    if (paced) pacer_report(&pacer, stdout);
+    pacer_free(&pacer);
+    if (mv) movie_close(mv);
+    if (rw) rewind_free(rw);
+    if (ra) {
+        run_ahead_report(ra, &c);
+        state_free(&ra->state);
+        free(ra);
+    }
+    if (trace) trace_close(trace);
+    if (prof) {
+        profile_report(prof, &v, stdout);
+        profile_write_collapsed(prof, &v, profile_path);
+        free(prof);
+    }
     return 0;
 }
+#endif
@@ -0,0 +1,77 @@
+import struct
+import sys
+
+# Decoder for the binary traces written by `main --trace FILE`
+
+RECORD = struct.Struct("<HBBBBBB")
+GAP = 1
+
+names = ["NOOP", "LDA", "SAM", "SAR", "JMP", "PSH", "POP", "CMP", "ADD", "AND", "OR", "NOT", "SHR", "SHL"]
+jumps = ["JAL", "JEQ", "JNE"]
+
+def format_operand(mode, a, b):
+    match mode:
+        case 0: return f"${a}"
+        case 1: return f"#{a}"
+        case 2: return f"@{a}"
+        case 3: return f"${a},{b}"
+        case 4: return f"#{a},{b}"
+        case 5: return f"@{a},{b}"
+        case 6: return "@C"
+        case 7: return "@PC"
+
+def format_instruction(value, a, b):
+    opcode, mode = value & 0x1F, value >> 5
+    if value == 0xFF:
+        return "HALT"
+    if opcode >= len(names):
+        return f"?{value:02x}"
+    if opcode == 4 and mode < len(jumps):
+        return f"{jumps[mode]} {a}"
+    if opcode in (0, 11): # NOOP and NOT take no operand
+        return names[opcode]
+    return f"{names[opcode]} {format_operand(mode, a, b)}"
+
+def read_trace(path):
+    with open(path, "rb") as f:
+        header = f.read(8)
+        if len(header) < 8 or header[:4] != b"8BTR":
+            raise ValueError(f"{path} is not a trace")
+        version, size = struct.unpack("<HH", header[4:])
+        if version != 1 or size != RECORD.size:
+            raise ValueError(f"Unsupported trace version {version}, record size {size}")
+        while chunk := f.read(RECORD.size * 4096):
+            for i in range(0, len(chunk) - RECORD.size + 1, RECORD.size):
+                yield RECORD.unpack_from(chunk, i)
+
+def main():
+    if len(sys.argv) < 2:
+        print(f"Usage: {sys.argv[0]} trace.bin [--summary]")
+        sys.exit(1)
+    summary = "--summary" in sys.argv[2:]
+
+    records = 0
+    dropped = 0
+    counts = {}
+    for pc, value, a, b, r0, flags, kind in read_trace(sys.argv[1]):
+        if kind == GAP:
+            lost = pc | value << 16 | a << 24
+            dropped += lost
+            if not summary:
+                print(f"... {lost} records dropped")
+            continue
+        records += 1
+        inst = format_instruction(value, a, b)
+        if summary:
+            name = inst.split()[0]
+            counts[name] = counts.get(name, 0) + 1
+        else:
+            print(f"{pc:04x}  {inst:<12} r0={r0:02x} flags={flags:02x}")
+
+    if summary:
+        print(f"{records} instructions, {dropped} dropped")
+        for name, count in sorted(counts.items(), key=lambda x: -x[1]):
+            print(f"  {name:<6} {count:>12} {100 * count / max(records, 1):5.1f}%")
+
+if __name__ == "__main__":
+    main()